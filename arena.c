@@ -0,0 +1,133 @@
+/* Free RAM regions, for staging and work buffers.
+ *
+ * The kernel only occupies a few KB near the middle of RAM; everything else
+ * (except the stack and the 0.18um flash microcode areas) is listed here.
+ * The kernel can grab permanent buffers with arena_alloc(), and the host can
+ * query what's left (SID_CONF_ARENA) to stage large transfers with SID_WMBA.
+ */
+
+/* (c) copyright a33b 2020
+ * GPLv3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+
+#include "stypes.h"
+#include "platf.h"
+#include "arena.h"
+#include "ovl.h"
+
+/* set at linkage */
+extern u8 rja_start[];
+extern u8 endpayload[];	//also in ovl.h
+extern u32 stackinit[];
+
+static struct arena_rgn arena[ARENA_MAXRGN];
+static unsigned arena_n;
+
+
+/** remove [start, last] from every region, splitting them if required */
+static void arena_carve(u32 start, u32 last) {
+	unsigned i;
+
+	for (i = 0; i < arena_n; i++) {
+		struct arena_rgn *r = &arena[i];
+
+		if ((last < r->start) || (start > r->last)) continue;
+
+		if ((start > r->start) && (last < r->last)) {
+			//hole in the middle : split. If the table is full, the upper part is lost.
+			if (arena_n < ARENA_MAXRGN) {
+				arena[arena_n].start = last + 1;
+				arena[arena_n].last = r->last;
+				arena_n++;
+			}
+			r->last = start - 1;
+		} else if (start <= r->start) {
+			if (last >= r->last) {
+				//completely covered
+				r->start = 1;
+				r->last = 0;
+			} else {
+				r->start = last + 1;
+			}
+		} else {
+			r->last = start - 1;
+		}
+	}
+}
+
+
+void arena_init(void) {
+	unsigned i, j;
+	u32 stack_top = (u32) stackinit + 3;
+
+	arena[0].start = RAM_MIN;
+	arena[0].last = RAM_MAX;
+	arena_n = 1;
+
+	arena_carve((u32) rja_start, (u32) endpayload - 1);
+	arena_carve(stack_top - STACK_RESERVE - 3, stack_top);
+	arena_carve(RAMJUMP_PRELOAD_META, RAMJUMP_PRELOAD_META + 0x3F);
+#ifdef FL_ERASE_BASE
+	arena_carve(FL_ERASE_BASE, FL_ERASE_BASE + FL_UCODE_SIZE - 1);
+	arena_carve(FL_WRITE_BASE, FL_WRITE_BASE + FL_UCODE_SIZE - 1);
+#endif
+#ifdef NPK_OVERLAYS
+	arena_carve((u32) ovl_start, (u32) ovl_end - 1);
+#endif
+
+	/* align to 4, drop empty / tiny regions, sort by address */
+	for (i = 0, j = 0; i < arena_n; i++) {
+		struct arena_rgn r = arena[i];
+		unsigned k;
+
+		if (r.start > r.last) continue;
+		r.start = (r.start + 3) & ~3;
+		r.last = ((r.last + 1) & ~3) - 1;
+		if ((r.start > r.last) || ((r.last - r.start + 1) < ARENA_MINRGN)) continue;
+
+		for (k = j; (k > 0) && (arena[k - 1].start > r.start); k--) {
+			arena[k] = arena[k - 1];
+		}
+		arena[k] = r;
+		j++;
+	}
+	arena_n = j;
+}
+
+
+void *arena_alloc(u32 len) {
+	unsigned i;
+
+	len = (len + 3) & ~3;
+	for (i = 0; i < arena_n; i++) {
+		struct arena_rgn *r = &arena[i];
+		u32 p = r->start;
+
+		if (len <= (r->last - p + 1)) {
+			r->start += len;
+			return (void *) p;
+		}
+	}
+	return NULL;
+}
+
+
+unsigned arena_get(const struct arena_rgn **rgns) {
+	*rgns = arena;
+	return arena_n;
+}
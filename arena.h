@@ -0,0 +1,51 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+/* Free RAM regions, for staging and work buffers */
+
+/* (c) copyright a33b 2020
+ * GPLv3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stypes.h"
+
+#define ARENA_MAXRGN	6
+#define ARENA_MINRGN	64	//smaller gaps aren't worth reporting
+
+/* [start, last] inclusive, since the 7051 RAM ends at 0xFFFFFFFF */
+struct arena_rgn {
+	u32 start;
+	u32 last;
+};
+
+/** Build the region list : all of RAM, minus the kernel image, stack (STACK_RESERVE),
+ * preload metadata and flash microcode areas. Must be called once at startup.
+ */
+void arena_init(void);
+
+/** Permanently carve len bytes (rounded up to 4) from the first region large enough.
+ *
+ * Kernel allocations must all be done at startup, before the host queries the regions.
+ * @return 4-byte aligned pointer, or NULL
+ */
+void *arena_alloc(u32 len);
+
+/** Get the current (unallocated) regions, sorted by address.
+ *
+ * @return number of regions
+ */
+unsigned arena_get(const struct arena_rgn **rgns);
+
+#endif
@@ -21,16 +21,31 @@
 
 #include <string.h>	//memcpy
 
+#include "extra_functions.h"
 #include "npk_ver.h"
 #include "platf.h"
 
+#include "arena.h"
 #include "eep_funcs.h"
 #include "iso_cmds.h"
 #include "npk_errcodes.h"
 #include "crc.h"
+#include "lzpack.h"
+#include "ovl.h"
 
 #define MAX_INTERBYTE	10	//ms between bytes that causes a disconnect
 
+/* packer entry point; if built as an overlay, LZ_READY() must be checked first */
+#ifdef OVL_LZPACK
+	#define LZ_READY()	(ovl_get(OVL_ID_LZPACK) != NULL)
+	#define LZ_PACK	(ovl_get(OVL_ID_LZPACK)->calls.lzpack.pack)
+#elif defined(NPK_ROMZ)
+	#define LZ_READY()	1
+	#define LZ_PACK	lz_pack
+#else
+	#define LZ_READY()	0
+#endif
+
 /* concatenate the ReadECUID positive response byte
  * in front of the version string
  */
@@ -51,7 +66,53 @@ struct iso14230_msg {
  * but not combine /overlap each buffer.
  * We just need to make sure the comms functions (iso_sendpkt, tx_7F etc) use their own
  * private buffers. */
-static u8 txbuf[256];
+static u8 txbuf[256] __attribute__ ((aligned (4)));
+
+/* event trace, see SID_CONF_TRACE */
+#ifdef NPK_TRACE
+struct trace_ent {
+	u32 ts;
+	u8 evt;
+	u8 a8;
+	u16 a16;
+};
+
+static struct {
+	struct trace_ent ring[NPK_TRACE_NENT];
+	unsigned idx;
+	u8 flags;
+} trace_buf;
+
+static void trace_evt(u8 evt, u8 a8, u16 a16) {
+	struct trace_ent *te;
+
+	if (trace_buf.flags & SID_TRACE_FROZEN) return;
+	te = &trace_buf.ring[trace_buf.idx];
+	te->ts = get_mclk_ts();
+	te->evt = evt;
+	te->a8 = a8;
+	te->a16 = a16;
+	trace_buf.idx += 1;
+	if (trace_buf.idx == NPK_TRACE_NENT) {
+		trace_buf.idx = 0;
+		trace_buf.flags |= SID_TRACE_WRAPPED;
+	}
+}
+	#define TRACE_EVT(evt, a8, a16) trace_evt((evt), (a8), (a16))
+#else
+	#define TRACE_EVT(evt, a8, a16) do {} while (0)
+#endif
+
+/* link error counters, see SID_CONF_LINKSTAT */
+#ifdef NPK_LINKSTAT
+static u16 linkstat[SID_LINKSTAT_NUM];
+
+static void linkstat_inc(unsigned idx) {
+	if (linkstat[idx] != 0xFFFF) linkstat[idx] += 1;
+}
+#else
+	#define linkstat_inc(idx) do {} while (0)
+#endif
 
 /** simple 8-bit sum */
 static uint8_t cks_u8(const uint8_t * data, unsigned int len) {
@@ -85,6 +146,7 @@ static u32 reconst_24(const u8 *data) {
  */
 static void sci_rxidle(unsigned ms) {
 	u32 t0, tc, intv;
+	bool purged = 0;
 
 	if (ms > MCLK_MAXSPAN) ms = MCLK_MAXSPAN;
 	intv = MCLK_GETTS(ms);	//# of ticks for delay
@@ -92,19 +154,64 @@ static void sci_rxidle(unsigned ms) {
 	t0 = get_mclk_ts();
 	while (1) {
 		tc = get_mclk_ts();
-		if ((tc - t0) >= intv) return;
+		if ((tc - t0) >= intv) break;
 
 		if (NPK_SCI.SSR.BYTE & 0x78) {
 			/* RDRF | ORER | FER | PER :reset timer */
+			purged = 1;
 			t0 = get_mclk_ts();
 			NPK_SCI.SSR.BYTE &= 0x87;	//clear RDRF + error flags
 		}
 	}
+	if (purged) {
+		linkstat_inc(SID_LINKSTAT_RESYNC);
+		TRACE_EVT(SID_TRACE_RESYNC, 0, ms);
+	}
+}
+
+#ifdef NPK_ATP
+/* timing parameters (see SID_ATP), in SID_ATP units : P2min, P2max, P3min, P3max, P4min */
+static const u8 atp_limits[SID_ATP_NPARAM] = {0, 0xFF, 0, 0xFF, 0};
+static const u8 atp_defaults[SID_ATP_NPARAM] = {0, 2, 0, 20, 0};
+static u8 atp_cur[SID_ATP_NPARAM] = {0, 2, 0, 20, 0};
+#define ATP_GETTS(x) ((x) * 10000 / 32)	/* convert 0.5ms units to MCLK ticks */
+static u32 atp_p2ticks;	//0 if no delay
+static u32 atp_p4ticks;
+
+static u32 t_rxdone;	//timestamp of the last complete request, for P2min
+static bool tx_started;	//set after the first byte of a frame, for P4min
+
+/** wait P4min after the end of the previous byte */
+static void sci_txgap(void) {
+	u32 t0;
+
+	while (!NPK_SCI.SSR.BIT.TEND) {}
+	t0 = get_mclk_ts();
+	while ((u32) (get_mclk_ts() - t0) < atp_p4ticks) {}
 }
+#endif
+
+/* set by cmd_bench() while the transmitter is disabled : skip all waits on TDRE / TEND,
+ * which aren't guaranteed to stay set with TE = 0 */
+#ifdef NPK_BENCH
+static bool tx_dry;
+#else
+	#define tx_dry	0
+#endif
 
 /** send a whole buffer, blocking. For use by iso_sendpkt() only */
 static void sci_txblock(const uint8_t *buf, uint32_t len) {
 	for (; len > 0; len--) {
+		if (tx_dry) {
+			NPK_SCI.TDR = *buf++;
+			continue;
+		}
+#ifdef NPK_ATP
+		if (atp_p4ticks) {
+			if (tx_started) sci_txgap();
+			tx_started = 1;
+		}
+#endif
 		while (!NPK_SCI.SSR.BIT.TDRE) {}	//wait for empty
 		NPK_SCI.TDR = *buf;
 		buf++;
@@ -127,6 +234,15 @@ static void iso_sendpkt(const uint8_t *buf, int len) {
 
 	if (len > 0xff) len = 0xff;
 
+#ifdef NPK_ATP
+	if (atp_p2ticks && !tx_dry) {
+		//no effect past the first frame of a response
+		while ((u32) (get_mclk_ts() - t_rxdone) < atp_p2ticks) {}
+	}
+	tx_started = 0;
+#endif
+	TRACE_EVT(SID_TRACE_TXSTART, buf[0], len);
+
 	NPK_SCI.SCR.BIT.RE = 0;
 
 	if (len <= 0x3F) {
@@ -145,7 +261,8 @@ static void iso_sendpkt(const uint8_t *buf, int len) {
 	sci_txblock(&cks, 1);	//cks
 
 	//ugly : wait for transmission end; this means re-enabling RX won't pick up a partial byte
-	while (!NPK_SCI.SSR.BIT.TEND) {}
+	while (!tx_dry && !NPK_SCI.SSR.BIT.TEND) {}
+	TRACE_EVT(SID_TRACE_TXEND, 0, 0);
 
 	NPK_SCI.SCR.BIT.RE = 1;
 	return;
@@ -191,6 +308,7 @@ static enum iso_prc iso_parserx(struct iso14230_msg *msg, u8 newbyte) {
 		//parse FMT byte
 		if ((newbyte & 0xC0) == 0x40) {
 			//CARB mode, not supported
+			linkstat_inc(SID_LINKSTAT_BADHDR);
 			return ISO_PRC_ERROR;
 		}
 		if (newbyte & 0x80) {
@@ -234,6 +352,7 @@ static enum iso_prc iso_parserx(struct iso14230_msg *msg, u8 newbyte) {
 	if (cks == msg->data[msg->datalen]) {
 		return ISO_PRC_DONE;
 	}
+	linkstat_inc(SID_LINKSTAT_BADCKS);
 	return ISO_PRC_ERROR;
 }
 
@@ -257,15 +376,159 @@ static enum t_flashsm {
  * FER will be set, etc.
  */
 
-void cmd_init(u8 brrdiv) {
-	cmstate = CM_IDLE;
-	flashstate = FL_IDLE;
+/** set SCI clock select (SMR.CKS, Pphi / 4^cks) and divisor */
+static void sci_setspeed(u8 cks, u8 brrdiv) {
 	NPK_SCI.SCR.BYTE &= 0xCF;	//disable TX + RX
-	NPK_SCI.BRR = brrdiv;		// speed = (div + 1) * 625k
+	NPK_SCI.SMR.BIT.CKS = cks;
+	NPK_SCI.BRR = brrdiv;		// speed = 625k / (div + 1) with CKS = 0
 	NPK_SCI.SSR.BYTE &= 0x87;	//clear RDRF + error flags
 	NPK_SCI.SCR.BYTE |= 0x30;	//enable TX+RX , no RX interrupts for now
+}
+
+void cmd_init(u8 brrdiv) {
+	cmstate = CM_IDLE;
+	flashstate = FL_IDLE;
+	sci_setspeed(0, brrdiv);
+	return;
+}
+
+#ifdef NPK_AUTOBAUD
+/* max time with interrupts masked while timing one sync byte : the WDT ISR runs every 2ms */
+#define AB_MASKMAX	MCLK_GETTS(1)
+
+/** wait until the pin reads <level>; ret 0 if more than tmo ticks elapsed since tref */
+static bool ab_wait(volatile const u16 *dr, u16 mask, bool level, u32 tref, u32 tmo) {
+	while (((*dr & mask) != 0) != level) {
+		if ((u32) (get_mclk_ts() - tref) > tmo) return 0;
+	}
+	return 1;
+}
+
+/** ab_wait() for one edge with interrupts masked since tmask : at most edge_tmo ticks,
+ * and never past AB_MASKMAX after tmask
+ */
+static bool ab_wait_masked(volatile const u16 *dr, u16 mask, bool level, u32 tmask, u32 edge_tmo) {
+	u32 now = get_mclk_ts();
+	u32 used = now - tmask;
+
+	if (used >= AB_MASKMAX) return 0;
+	if (edge_tmo > (AB_MASKMAX - used)) edge_tmo = AB_MASKMAX - used;
+	return ab_wait(dr, mask, level, now, edge_tmo);
+}
+
+/** time SID_AUTOBAUD_NSYNC 0x55 bytes on the RX pin, see SID_CONF_AUTOBAUD.
+ *
+ * In each byte, times from the rising edge after the start bit to the rising edge
+ * of the stop bit (8 bit times), so every timestamp sees the same polling latency.
+ * Interrupts are masked for one byte at a time only, never more than AB_MASKMAX, to keep
+ * the WDT going : this limits the lowest usable speed to ~10kbps.
+ * Once the first byte is timed, every edge must come within 3 bit times, so a glitch
+ * or a byte other than 0x55 fails quickly.
+ * @return total ticks for (8 * SID_AUTOBAUD_NSYNC) bit times, or 0 if failed
+ */
+static u32 autobaud_measure(volatile const u16 *dr, u16 mask) {
+	u32 tstart, span = 0;
+	u32 edge_tmo = AB_MASKMAX;
+	unsigned nb;
+
+	tstart = get_mclk_ts();
+	//line must be idle first
+	if (!ab_wait(dr, mask, 1, tstart, MCLK_GETTS(SID_AUTOBAUD_TMO))) return 0;
+
+	for (nb = 0; nb < SID_AUTOBAUD_NSYNC; nb++) {
+		u32 t0, tmask, bspan;
+		unsigned edge, uim;
+		bool ok;
+
+		//start bit
+		if (!ab_wait(dr, mask, 0, tstart, MCLK_GETTS(SID_AUTOBAUD_TMO))) return 0;
+		uim = imask_savedisable();
+		tmask = get_mclk_ts();
+		ok = ab_wait_masked(dr, mask, 1, tmask, edge_tmo);
+		t0 = get_mclk_ts();
+		for (edge = 0; ok && (edge < 8); edge++) {
+			ok = ab_wait_masked(dr, mask, (edge & 1), tmask, edge_tmo);
+		}
+		bspan = get_mclk_ts() - t0;
+		imask_restore(uim);
+		if (!ok) return 0;
+
+		if (nb == 0) {
+			edge_tmo = ((3 * bspan) / 8) + 2;
+		}
+		span += bspan;
+	}
+	return span;
+}
+
+/** pick BRR for a measured span (see autobaud_measure()) and switch to it.
+ * ATU0 ticks are 32 Pphi cycles, so with CKS = 0 the bit time in ticks is exactly (BRR + 1).
+ * AB_MASKMAX keeps the bit time well under 256 ticks, so CKS = 0 always fits.
+ * @return 0 if no setting fits
+ */
+static bool autobaud_set(u32 span) {
+	u32 div = 8 * SID_AUTOBAUD_NSYNC;
+	u32 n1 = (span + (div / 2)) / div;	//BRR + 1
+
+	if ((n1 < 1) || (n1 > 256)) return 0;
+	cmstate = CM_IDLE;
+	sci_setspeed(0, n1 - 1);
+	return 1;
+}
+#endif
+
+#ifdef NPK_ATP
+/* AccessTimingParameters : <SID_ATP> <TPI> [<P2min> <P2max> <P3min> <P3max> <P4min>] */
+static void cmd_atp(struct iso14230_msg *msg) {
+	const u8 *newp = NULL;
+	unsigned resplen = 2;
+
+	if (msg->datalen < 2) goto bad12;
+	txbuf[0] = SID_ATP + 0x40;
+	txbuf[1] = msg->data[1];
+
+	switch (msg->data[1]) {
+	case SID_ATP_LIMITS:
+	case SID_ATP_CURRENT:
+		if (msg->datalen != 2) goto bad12;
+		memcpy(&txbuf[2], (msg->data[1] == SID_ATP_LIMITS) ? atp_limits : atp_cur, SID_ATP_NPARAM);
+		resplen += SID_ATP_NPARAM;
+		break;
+	case SID_ATP_DEFAULTS:
+		if (msg->datalen != 2) goto bad12;
+		newp = atp_defaults;
+		break;
+	case SID_ATP_SET:
+		if (msg->datalen != (2 + SID_ATP_NPARAM)) goto bad12;
+		newp = &msg->data[2];
+		/* atp_limits holds the lowest P2min, P3min, P4min and highest P2max, P3max we accept.
+		 * Reject anything outside those, or an inverted window, and keep the current values */
+		if (	(newp[0] < atp_limits[0]) || (newp[1] > atp_limits[1]) ||
+			(newp[2] < atp_limits[2]) || (newp[3] > atp_limits[3]) ||
+			(newp[4] < atp_limits[4]) || (newp[4] > SID_ATP_P4MAX) ||
+			(newp[0] > (newp[1] * 50)) || (newp[2] > (newp[3] * 500))) {	//0.5ms vs 25ms, 0.5ms vs 250ms units
+			tx_7F(SID_ATP, ISO_NRC_CNCORSE);
+			return;
+		}
+		break;
+	default:
+		goto bad12;
+		break;
+	}
+
+	iso_sendpkt(txbuf, resplen);
+	if (newp) {
+		memcpy(atp_cur, newp, SID_ATP_NPARAM);
+		atp_p2ticks = ATP_GETTS(atp_cur[0]);
+		atp_p4ticks = ATP_GETTS(atp_cur[4]);
+	}
+	return;
+
+bad12:
+	tx_7F(SID_ATP, ISO_NRC_SFNS_IF);
 	return;
 }
+#endif
 
 static void cmd_startcomm(void) {
 	// KW : noaddr;  len-in-fmt or lenbyte
@@ -274,6 +537,213 @@ static void cmd_startcomm(void) {
 	flashstate = FL_IDLE;
 }
 
+/* crc16 cache, one entry per ROMCRC_CHUNKSIZE granule of flash. Filled when cmd_loop() is idle
+ * and invalidated by flash_eb() / flash_wb(). Not used if the arena was too small. */
+#ifdef NPK_CRCMAP
+#define CRCMAP_NG	((FL_MAXROM + 1) / ROMCRC_CHUNKSIZE)
+static u16 *crcmap;	//NULL if disabled
+static u32 *crcmap_valid;	//bitmap, bit (g % 32) of word (g / 32) for granule g
+static unsigned crcmap_next;	//word of crcmap_valid to look at next
+
+static void crcmap_init(void) {
+	crcmap = arena_alloc((CRCMAP_NG * 2) + (CRCMAP_NG / 8));
+	if (!crcmap) return;
+	crcmap_valid = (u32 *) &crcmap[CRCMAP_NG];
+	memset(crcmap_valid, 0, CRCMAP_NG / 8);
+}
+
+/** invalidate the granules that overlap [start, start + len) */
+static void crcmap_inval(u32 start, u32 len) {
+	u32 g, glast;
+
+	if (!crcmap || !len || (start > FL_MAXROM)) return;
+	glast = start + len - 1;
+	if ((glast > FL_MAXROM) || (glast < start)) glast = FL_MAXROM;
+	glast /= ROMCRC_CHUNKSIZE;
+	for (g = start / ROMCRC_CHUNKSIZE; g <= glast; g++) {
+		crcmap_valid[g / 32] &= ~(1UL << (g % 32));
+	}
+}
+
+/** compute one missing entry, if any. Takes ~80us, which still leaves time to
+ * read RDR before an overrun at 62.5kbps (and up to ~125kbps)
+ */
+static void crcmap_idle(void) {
+	u32 w, g;
+
+	if (!crcmap) return;
+	w = crcmap_valid[crcmap_next];
+	if (w == 0xFFFFFFFF) {
+		crcmap_next = (crcmap_next + 1) % (CRCMAP_NG / 32);
+		return;
+	}
+	for (g = 0; w & (1UL << g); g++) {}
+	w = (crcmap_next * 32) + g;
+	crcmap[w] = crc16((const u8 *) (w * ROMCRC_CHUNKSIZE), ROMCRC_CHUNKSIZE);
+	crcmap_valid[crcmap_next] |= 1UL << g;
+}
+#else
+	#define crcmap_init() do {} while (0)
+	#define crcmap_inval(start, len) do {} while (0)
+	#define crcmap_idle() do {} while (0)
+#endif
+
+/** crc16 of [addr, addr + len), from the cache when it's exactly one cached flash granule */
+static u16 crc16_cached(u32 addr, u32 len) {
+#ifdef NPK_CRCMAP
+	u32 g = addr / ROMCRC_CHUNKSIZE;
+
+	if (crcmap && (len == ROMCRC_CHUNKSIZE) &&
+		!(addr % ROMCRC_CHUNKSIZE) && (addr <= FL_MAXROM)) {
+		if (!(crcmap_valid[g / 32] & (1UL << (g % 32)))) {
+			crcmap[g] = crc16((const u8 *) addr, len);
+			crcmap_valid[g / 32] |= 1UL << (g % 32);
+		}
+		return crcmap[g];
+	}
+#endif
+	return crc16((const u8 *) addr, len);
+}
+
+#ifdef NPK_ABORT
+static u32 abort_tlast;	//end of the last listen window
+
+/** check for a host abort request (see SID_ABORT_INTV) between frames or chunks of a long operation.
+ *
+ * @param listen : set when called between our own frames : then every SID_ABORT_INTV ms,
+ *	wait SID_ABORT_WIN byte times for the host to be heard.
+ * @return 1 if anything was received; RX is then purged.
+ */
+static bool abort_poll(bool listen) {
+	if (listen && ((u32) (get_mclk_ts() - abort_tlast) >= MCLK_GETTS(SID_ABORT_INTV))) {
+		//with CKS = 0, a bit lasts (BRR + 1) ticks
+		u32 win = (SID_ABORT_WIN * 10 * (NPK_SCI.BRR + 1)) << (2 * NPK_SCI.SMR.BIT.CKS);
+		u32 t0 = get_mclk_ts();
+
+		while (!(NPK_SCI.SSR.BYTE & 0x78) && ((u32) (get_mclk_ts() - t0) < win)) {}
+		abort_tlast = get_mclk_ts();
+	}
+	if (!(NPK_SCI.SSR.BYTE & 0x78)) return 0;	//RDRF | ORER | FER | PER
+
+	sci_rxidle(MAX_INTERBYTE);
+	return 1;
+}
+#else
+	#define abort_poll(listen)	0
+#endif
+
+/** send a ROM area as plain dump frames : <SID_DUMP + 0x40> <D0>...<D(pktmax - 1)>
+ * @return 1 if aborted
+ */
+static bool dump_rom(u32 addr, u32 len, u32 pktmax) {
+	txbuf[0] = SID_DUMP + 0x40;
+	while (len) {
+		u32 pktlen;
+		pktlen = len;
+		if (pktlen > pktmax) pktlen = pktmax;
+		memcpy(&txbuf[1], (void *) addr, pktlen);
+		iso_sendpkt(txbuf, pktlen + 1);
+		len -= pktlen;
+		addr += pktlen;
+		if (abort_poll(1)) return 1;
+	}
+	return 0;
+}
+
+#ifdef NPK_ROMZ
+/** send a ROM area as packed dump frames, see SID_DUMP_ROMZ
+ * @return 1 if aborted
+ */
+static bool dump_romz(u32 addr, u32 len) {
+	txbuf[0] = SID_DUMP + 0x40;
+	while (len) {
+		u32 ulen, plen;
+		u16 crc;
+
+		ulen = len;
+		if (ulen > SID_DUMPZ_MAXIN) ulen = SID_DUMPZ_MAXIN;
+		ulen = LZ_PACK((const u8 *) addr, ulen, &txbuf[5], SID_DUMPZ_PKMAX, &plen);
+		crc = crc16((const u8 *) addr, ulen);
+
+		txbuf[1] = ulen >> 8;
+		txbuf[2] = ulen & 0xFF;
+		txbuf[3] = crc >> 8;
+		txbuf[4] = crc & 0xFF;
+		iso_sendpkt(txbuf, plen + 5);
+		len -= ulen;
+		addr += ulen;
+		if (abort_poll(1)) return 1;
+	}
+	return 0;
+}
+#endif
+
+#ifdef NPK_DUMPDIFF
+/* incremental dump : compare host-supplied crc16 of every granule,
+ * and only send the granules that differ. See SID_DUMP_DIFF.
+ * args[0] : <GS>, args[1..3] : address, args[4...] : CRCs
+ */
+static void dump_diff(const u8 *args, unsigned nargs) {
+	u32 addr, gsize;
+	unsigned ng, idx;
+	bool packed;
+	u8 map[(SID_DUMPD_MAXG + 7) / 8];
+
+	if ((nargs < 6) || (nargs & 1)) goto bad12;
+	ng = (nargs - 4) / 2;
+	gsize = (args[0] & SID_DUMPD_GSMASK) * SID_DUMPD_GSUNIT;
+	packed = args[0] & SID_DUMPD_PACKED;
+	if ((ng > SID_DUMPD_MAXG) || (gsize == 0)) goto bad12;
+	if (packed && !LZ_READY()) {
+		tx_7F(SID_DUMP, ISO_NRC_CNCORSE);
+		return;
+	}
+
+	addr = reconst_24(&args[1]);
+	args += 4;
+
+	/* 1) changed-granules bitmap */
+	memset(map, 0, sizeof(map));
+	for (idx = 0; idx < ng; idx++) {
+		u16 crc = crc16_cached(addr + (idx * gsize), gsize);
+		if (crc != ((args[idx * 2] << 8) | args[idx * 2 + 1])) {
+			map[idx / 8] |= 0x80 >> (idx % 8);
+		}
+		if (abort_poll(0)) goto aborted;
+	}
+	txbuf[0] = SID_DUMP + 0x40;
+	txbuf[1] = ng;
+	memcpy(&txbuf[2], map, (ng + 7) / 8);
+	iso_sendpkt(txbuf, 2 + ((ng + 7) / 8));
+
+	/* 2) data for changed granules, in order */
+	for (idx = 0; idx < ng; idx++, addr += gsize) {
+		bool ab;
+
+		if (!(map[idx / 8] & (0x80 >> (idx % 8)))) continue;
+#ifdef NPK_ROMZ
+		if (packed) {
+			ab = dump_romz(addr, gsize);
+		} else {
+			ab = dump_rom(addr, gsize, SID_DUMPD_PKTLEN);
+		}
+#else
+		ab = dump_rom(addr, gsize, SID_DUMPD_PKTLEN);
+#endif
+		if (ab) goto aborted;
+	}
+	return;
+
+aborted:
+	tx_7F(SID_DUMP, NPK_NRC_ABORTED);
+	return;
+
+bad12:
+	tx_7F(SID_DUMP, ISO_NRC_SFNS_IF);
+	return;
+}
+#endif
+
 /* dump command processor, called from cmd_loop.
  * args[0] : address space (0: EEPROM, 1: ROM)
  * args[1,2] : # of 32-byte blocks
@@ -285,6 +755,10 @@ static void cmd_startcomm(void) {
  * ex.: "00 00 02 00 01" dumps 64 bytes @ EEPROM 0x20 (== address 0x10 in 93C66)
  * ex.: "01 80 00 00 00" dumps 1MB of ROM@ 0x0
  *
+ * space 2 (SID_DUMP_ROMZ) is like ROM, but each frame holds a packed chunk of up to
+ * SID_DUMPZ_MAXIN bytes, preceded by its unpacked length and crc16.
+ *
+ * space 3 (SID_DUMP_DIFF) has a different format, see iso_cmds.h
  */
 static void cmd_dump(struct iso14230_msg *msg) {
 	u32 addr;
@@ -292,6 +766,13 @@ static void cmd_dump(struct iso14230_msg *msg) {
 	u8 space;
 	u8 *args = &msg->data[1];	//skip SID byte
 
+#ifdef NPK_DUMPDIFF
+	if ((msg->datalen >= 2) && (args[0] == SID_DUMP_DIFF)) {
+		dump_diff(&args[1], msg->datalen - 2);
+		return;
+	}
+#endif
+
 	if (msg->datalen != 6) {
 		tx_7F(SID_DUMP, ISO_NRC_SFNS_IF);
 		return;
@@ -311,7 +792,6 @@ static void cmd_dump(struct iso14230_msg *msg) {
 			u16 *ebuf=&pbuf[1];	//cheat : form an ISO packet with the pos resp code in pbuf[0]
 
 			int pktlen;
-			int ecur;
 
 			pstart = (u8 *)(pbuf) + 1;
 			*pstart = SID_DUMP + 0x40;
@@ -319,28 +799,34 @@ static void cmd_dump(struct iso14230_msg *msg) {
 			pktlen = len;
 			if (pktlen > 32) pktlen = 32;
 
-			for (ecur = 0; ecur < (pktlen / 2); ecur += 1) {
-				eep_read16((uint8_t) addr + ecur, (uint16_t *)&ebuf[ecur]);
-			}
+			eep_readn((u16) addr, ebuf, pktlen / 2);
 			iso_sendpkt(pstart, pktlen + 1);
 
 			len -= pktlen;
 			addr += (pktlen / 2);	//work in eeprom addresses
+			if (abort_poll(1)) {
+				tx_7F(SID_DUMP, NPK_NRC_ABORTED);
+				break;
+			}
 		}
 		break;
 	case SID_DUMP_ROM:
 		/* dump from ROM */
-		txbuf[0] = SID_DUMP + 0x40;
-		while (len) {
-			int pktlen;
-			pktlen = len;
-			if (pktlen > 32) pktlen = 32;
-			memcpy(&txbuf[1], (void *) addr, pktlen);
-			iso_sendpkt(txbuf, pktlen + 1);
-			len -= pktlen;
-			addr += pktlen;
+		if (dump_rom(addr, len, 32)) {
+			tx_7F(SID_DUMP, NPK_NRC_ABORTED);
+		}
+		break;
+#ifdef NPK_ROMZ
+	case SID_DUMP_ROMZ:
+		if (!LZ_READY()) {
+			tx_7F(SID_DUMP, ISO_NRC_CNCORSE);
+			break;
+		}
+		if (dump_romz(addr, len)) {
+			tx_7F(SID_DUMP, NPK_NRC_ABORTED);
 		}
 		break;
+#endif
 	default:
 		tx_7F(SID_DUMP, ISO_NRC_SFNS_IF);
 		break;
@@ -389,7 +875,7 @@ static int cmd_romcrc(const u8 *data) {
 		data += 2;
 		u16 test_crc = (*(data+0) << 8) | *(data+1);
 		u32 start = chunkno * ROMCRC_CHUNKSIZE;
-		crc = crc16((const u8 *)start, ROMCRC_CHUNKSIZE);
+		crc = crc16_cached(start, ROMCRC_CHUNKSIZE);
 		if (crc != test_crc) {
 			return -1;
 		}
@@ -399,6 +885,130 @@ static int cmd_romcrc(const u8 *data) {
 	return 0;
 }
 
+#ifdef NPK_CKSUM
+/** add or xor all words of a range to acc, see SID_CONF_CKSUM. No alignment checks */
+static u32 mem_cksum(u32 acc, u32 addr, u32 len, u8 mode) {
+	bool xor = ((mode & SID_CKSUM_OPMASK) == SID_CKSUM_XOR);
+	bool le = mode & SID_CKSUM_LE;
+
+	if ((mode & SID_CKSUM_OPMASK) == SID_CKSUM_CRC32) {
+		return crc32_upd(acc, (const u8 *) addr, len);
+	}
+
+	switch (mode & SID_CKSUM_WMASK) {
+	case SID_CKSUM_W16:
+		for (; len >= 2; len -= 2, addr += 2) {
+			u32 v = *(const u16 *) addr;
+			if (le) v = ((v & 0xFF) << 8) | (v >> 8);
+			acc = xor ? (acc ^ v) : (acc + v);
+		}
+		break;
+	case SID_CKSUM_W32:
+		for (; len >= 4; len -= 4, addr += 4) {
+			u32 v = *(const u32 *) addr;
+			if (le) {
+				v = (v >> 24) | ((v >> 8) & 0xFF00) | ((v << 8) & 0xFF0000) | (v << 24);
+			}
+			acc = xor ? (acc ^ v) : (acc + v);
+		}
+		break;
+	default:
+		for (; len; len--, addr++) {
+			u32 v = *(const u8 *) addr;
+			acc = xor ? (acc ^ v) : (acc + v);
+		}
+		break;
+	}
+	return acc;
+}
+
+/* sum / xor checksum over ranges. data is the first byte after SID_CONF_CKSUM
+ * ret 0 if ok (response sent, or aborted)
+ */
+static int cmd_cksum(const u8 *data, unsigned dlen) {
+	u32 acc = 0;
+	u32 wmask;
+	u8 mode;
+
+	if ((dlen < 7) || ((dlen - 1) % 6)) return -1;
+	mode = *data++;
+	dlen -= 1;
+
+	switch (mode & SID_CKSUM_WMASK) {
+	case SID_CKSUM_W8:
+		wmask = 0;
+		break;
+	case SID_CKSUM_W16:
+		wmask = 1;
+		break;
+	case SID_CKSUM_W32:
+		wmask = 3;
+		break;
+	default:
+		return -1;
+	}
+
+	for (; dlen; dlen -= 6, data += 6) {
+		u32 addr = reconst_24(data);
+		u32 len = (data[3] << 16) | (data[4] << 8) | data[5];
+		if ((addr | len) & wmask) return -1;
+		while (len) {
+			u32 clen = (len > SID_ABORT_CHUNK) ? SID_ABORT_CHUNK : len;
+
+			acc = mem_cksum(acc, addr, clen, mode);
+			addr += clen;
+			len -= clen;
+			if (abort_poll(0)) {
+				tx_7F(SID_CONF, NPK_NRC_ABORTED);
+				return 0;
+			}
+		}
+	}
+
+	txbuf[0] = SID_CONF + 0x40;
+	txbuf[1] = acc >> 24;
+	txbuf[2] = acc >> 16;
+	txbuf[3] = acc >> 8;
+	txbuf[4] = acc & 0xFF;
+	iso_sendpkt(txbuf, 5);
+	return 0;
+}
+#endif
+
+/** erase / write wrappers; return 0 if ok, or a valid extended NRC.
+ * All flash modifications from the command handlers go through these.
+ */
+static u32 flash_eb(unsigned blockno) {
+	u32 rv;
+	unsigned blk;
+
+	TRACE_EVT(SID_TRACE_EBSTART, blockno, 0);
+	for (blk = 0; (blk < blockno) && (fblocks[blk] <= FL_MAXROM); blk++) {}
+	if ((blk == blockno) && (fblocks[blk] <= FL_MAXROM)) {
+		//valid block : invalidate even if the erase fails, it may be partly done
+		crcmap_inval(fblocks[blk], fblocks[blk + 1] - fblocks[blk]);
+	}
+	rv = platf_flash_eb(blockno);
+	if (rv) {
+		rv = (rv & 0xFF) | 0x80;	//make sure it's a valid extented NRC
+	}
+	TRACE_EVT(SID_TRACE_EBEND, rv, platf_flash_eb_pulses());
+	return rv;
+}
+
+static u32 flash_wb(u32 dest, u32 src, u32 len) {
+	u32 rv;
+
+	TRACE_EVT(SID_TRACE_WBSTART, dest >> 16, dest);
+	crcmap_inval(dest, len);
+	rv = platf_flash_wb(dest, src, len);
+	if (rv) {
+		rv = (rv & 0xFF) | 0x80;	//make sure it's a valid extented NRC
+	}
+	TRACE_EVT(SID_TRACE_WBEND, rv, len / SIDFL_WB_DLEN);
+	return rv;
+}
+
 /* handle low-level reflash commands */
 static void cmd_flash_utils(struct iso14230_msg *msg) {
 	u8 subcommand;
@@ -420,16 +1030,25 @@ static void cmd_flash_utils(struct iso14230_msg *msg) {
 
 	switch(subcommand) {
 	case SIDFL_EB:
-		//format : <SID_FLASH> <SIDFL_EB> <BLOCKNO>
+	case SIDFL_EBP:
+		//format : <SID_FLASH> <SIDFL_EB or SIDFL_EBP> <BLOCKNO>
 		if (msg->datalen != 3) {
 			rv = ISO_NRC_SFNS_IF;
 			goto exit_bad;
 		}
-		rv = platf_flash_eb(msg->data[2]);
+		rv = flash_eb(msg->data[2]);
 		if (rv) {
-			rv = (rv & 0xFF) | 0x80;	//make sure it's a valid extented NRC
 			goto exit_bad;
 		}
+		if (subcommand == SIDFL_EB) {
+			break;
+		}
+		tmp = platf_flash_eb_pulses();
+		txbuf[0] = SID_FLASH + 0x40;
+		txbuf[1] = tmp >> 8;
+		txbuf[2] = tmp & 0xFF;
+		iso_sendpkt(txbuf, 3);
+		return;
 		break;
 	case SIDFL_WB:
 		//format : <SID_FLASH> <SIDFL_WB> <A2> <A1> <A0> <D0>...<D127> <CRC>
@@ -444,53 +1063,227 @@ static void cmd_flash_utils(struct iso14230_msg *msg) {
 		}
 
 		tmp = (msg->data[2] << 16) | (msg->data[3] << 8) | msg->data[4];
-		rv = platf_flash_wb(tmp, (u32) &msg->data[5], SIDFL_WB_DLEN);
+		rv = flash_wb(tmp, (u32) &msg->data[5], SIDFL_WB_DLEN);
 		if (rv) {
-			rv = (rv & 0xFF) | 0x80;	//make sure it's a valid extented NRC
 			goto exit_bad;
 		}
 		break;
-	case SIDFL_UNPROTECT:
-		//format : <SID_FLASH> <SIDFL_UNPROTECT> <~SIDFL_UNPROTECT>
-		if (msg->datalen != 3) {
+#ifdef NPK_FLWR
+	case SIDFL_WR: {
+		//format : <SID_FLASH> <SIDFL_WR> <D2> <D1> <D0> <S2> <S1> <S0> <NH> <NL> <CRCH> <CRCL>
+		u32 src;
+		u32 len;
+
+		if (msg->datalen != 12) {
 			rv = ISO_NRC_SFNS_IF;
 			goto exit_bad;
 		}
-		if (msg->data[2] != (u8) ~SIDFL_UNPROTECT) {
-			rv = ISO_NRC_IK;	//InvalidKey
+
+		tmp = (msg->data[2] << 16) | (msg->data[3] << 8) | msg->data[4];
+		src = reconst_24(&msg->data[5]);
+		len = ((msg->data[8] << 8) | msg->data[9]) * SIDFL_WB_DLEN;
+
+		// staging area must be entirely in RAM, destination entirely in flash
+		if (	(len == 0) ||
+			(src < RAM_MIN) ||
+			(src > RAM_MAX) ||
+			(len > (RAM_MAX - src + 1)) ||
+			(tmp > FL_MAXROM) ||
+			(len > (FL_MAXROM - tmp + 1))) {
+			rv = ISO_NRC_CNDTSA;
 			goto exit_bad;
 		}
 
-		platf_flash_unprotect();
-		break;
-	default:
-		rv = ISO_NRC_SFNS_IF;
-		goto exit_bad;
-		break;
-	}
-
-	txbuf[0] = SID_FLASH + 0x40;
-	iso_sendpkt(txbuf, 1);	//positive resp
-	return;
-
-exit_bad:
-	tx_7F(SID_FLASH, rv);
-	return;
-}
+		if (crc16((const u8 *) src, len) != ((msg->data[10] << 8) | msg->data[11])) {
+			rv = SID_CONF_CKS1_BADCKS;
+			goto exit_bad;
+		}
 
+		rv = flash_wb(tmp, src, len);
+		if (rv) {
+			goto exit_bad;
+		}
+		break;
+		}
+	case SIDFL_WRS: {
+		//format : <SID_FLASH> <SIDFL_WRS> <D2> <D1> <D0> <S2> <S1> <S0> <NH> <NL> <CRCH> <CRCL> <bitmap>
+		const u8 *map = &msg->data[12];
+		u32 src;
+		unsigned np, idx, nstaged;
+
+		np = (msg->data[8] << 8) | msg->data[9];
+		if (	(msg->datalen < 13) ||
+			(np == 0) ||
+			(np > SIDFL_WRS_MAXPAGES) ||
+			(msg->datalen != (int) (12 + ((np + 7) / 8)))) {
+			rv = ISO_NRC_SFNS_IF;
+			goto exit_bad;
+		}
 
-/* ReadMemByAddress */
-static void cmd_rmba(struct iso14230_msg *msg) {
-	//format : <SID_RMBA> <AH> <AM> <AL> <SIZ>
-	/* response : <SID + 0x40> <D0>....<Dn> <AH> <AM> <AL> */
+		tmp = (msg->data[2] << 16) | (msg->data[3] << 8) | msg->data[4];
+		src = reconst_24(&msg->data[5]);
 
-	u32 addr;
-	int siz;
+		//check the whole destination first, so nothing gets programmed if it doesn't fit
+		if (	(tmp % SIDFL_WB_DLEN) ||
+			(tmp > FL_MAXROM) ||
+			((np * SIDFL_WB_DLEN) > (FL_MAXROM - tmp + 1))) {
+			rv = ISO_NRC_CNDTSA;
+			goto exit_bad;
+		}
 
-	if (msg->datalen != 5) goto bad12;
-	siz = msg->data[4];
+		for (idx = 0, nstaged = 0; idx < np; idx++) {
+			if (map[idx / 8] & (0x80 >> (idx % 8))) nstaged++;
+		}
+		if (nstaged &&
+			(	(src < RAM_MIN) ||
+				(src > RAM_MAX) ||
+				((nstaged * SIDFL_WB_DLEN) > (RAM_MAX - src + 1)))) {
+			rv = ISO_NRC_CNDTSA;
+			goto exit_bad;
+		}
+		if (crc16((const u8 *) src, nstaged * SIDFL_WB_DLEN) != ((msg->data[10] << 8) | msg->data[11])) {
+			rv = SID_CONF_CKS1_BADCKS;
+			goto exit_bad;
+		}
 
-	if ((siz == 0) || (siz > 251)) goto bad12;
+		/* absent pages go through the backend's all-0xFF path, which only checks that they're blank */
+		memset(txbuf, 0xFF, SIDFL_WB_DLEN);
+		for (idx = 0; idx < np; ) {
+			unsigned run;
+
+			for (run = 0; (idx + run) < np; run++) {
+				if (!(map[(idx + run) / 8] & (0x80 >> ((idx + run) % 8)))) break;
+			}
+			if (run) {
+				//program consecutive staged pages in one go
+				rv = flash_wb(tmp, src, run * SIDFL_WB_DLEN);
+				src += run * SIDFL_WB_DLEN;
+			} else {
+				run = 1;
+				rv = flash_wb(tmp, (u32) txbuf, SIDFL_WB_DLEN);
+			}
+			if (rv) {
+				goto exit_bad;
+			}
+			tmp += run * SIDFL_WB_DLEN;
+			idx += run;
+		}
+		break;
+		}
+#endif
+#ifdef NPK_FLCPY
+	case SIDFL_CPY: {
+		//format : <SID_FLASH> <SIDFL_CPY> <D2> <D1> <D0> <S2> <S1> <S0> <NH> <NL> <FLAGS>
+		u32 src, len;
+		unsigned blk;
+
+		if (msg->datalen != 11) {
+			rv = ISO_NRC_SFNS_IF;
+			goto exit_bad;
+		}
+		tmp = (msg->data[2] << 16) | (msg->data[3] << 8) | msg->data[4];
+		src = (msg->data[5] << 16) | (msg->data[6] << 8) | msg->data[7];
+		len = ((msg->data[8] << 8) | msg->data[9]) * SIDFL_WB_DLEN;
+
+		if (	(len == 0) ||
+			(tmp % SIDFL_WB_DLEN) ||
+			(tmp > FL_MAXROM) ||
+			(src > FL_MAXROM) ||
+			(len > (FL_MAXROM - tmp + 1)) ||
+			(len > (FL_MAXROM - src + 1)) ||
+			((src < (tmp + len)) && (tmp < (src + len)))) {
+			rv = ISO_NRC_CNDTSA;
+			goto exit_bad;
+		}
+
+		if (msg->data[10] & SIDFL_CPY_ERASE) {
+			//check all affected blocks before erasing anything
+			for (blk = 0; fblocks[blk] <= FL_MAXROM; blk++) {
+				if ((fblocks[blk] >= (tmp + len)) || (fblocks[blk + 1] <= tmp)) continue;
+				if ((fblocks[blk] < (src + len)) && (src < fblocks[blk + 1])) {
+					rv = ISO_NRC_CNDTSA;
+					goto exit_bad;
+				}
+			}
+			for (blk = 0; fblocks[blk] <= FL_MAXROM; blk++) {
+				if ((fblocks[blk] >= (tmp + len)) || (fblocks[blk + 1] <= tmp)) continue;
+				rv = flash_eb(blk);
+				if (rv) {
+					goto exit_bad;
+				}
+			}
+		} else {
+			const u32 *pd;
+			for (pd = (const u32 *) tmp; pd < (const u32 *) (tmp + len); pd++) {
+				if (*pd != 0xFFFFFFFF) {
+					rv = ISO_NRC_CNCORSE;
+					goto exit_bad;
+				}
+			}
+		}
+
+		/* flash can't be read while programming : stage a few pages at a time in txbuf */
+		while (len) {
+			u32 clen = (len > sizeof(txbuf)) ? sizeof(txbuf) : len;
+
+			memcpy(txbuf, (const void *) src, clen);
+			rv = flash_wb(tmp, (u32) txbuf, clen);
+			if (rv) {
+				goto exit_bad;
+			}
+			tmp += clen;
+			src += clen;
+			len -= clen;
+			if (len && abort_poll(0)) {
+				rv = NPK_NRC_ABORTED;
+				goto exit_bad;
+			}
+		}
+		break;
+		}
+#endif
+	case SIDFL_UNPROTECT:
+		//format : <SID_FLASH> <SIDFL_UNPROTECT> <~SIDFL_UNPROTECT>
+		if (msg->datalen != 3) {
+			rv = ISO_NRC_SFNS_IF;
+			goto exit_bad;
+		}
+		if (msg->data[2] != (u8) ~SIDFL_UNPROTECT) {
+			rv = ISO_NRC_IK;	//InvalidKey
+			goto exit_bad;
+		}
+
+		platf_flash_unprotect();
+		break;
+	default:
+		rv = ISO_NRC_SFNS_IF;
+		goto exit_bad;
+		break;
+	}
+
+	txbuf[0] = SID_FLASH + 0x40;
+	iso_sendpkt(txbuf, 1);	//positive resp
+	return;
+
+exit_bad:
+	if (rv == SID_CONF_CKS1_BADCKS) linkstat_inc(SID_LINKSTAT_FLCKS);
+	tx_7F(SID_FLASH, rv);
+	return;
+}
+
+
+/* ReadMemByAddress */
+static void cmd_rmba(struct iso14230_msg *msg) {
+	//format : <SID_RMBA> <AH> <AM> <AL> <SIZ>
+	/* response : <SID + 0x40> <D0>....<Dn> <AH> <AM> <AL> */
+
+	u32 addr;
+	int siz;
+
+	if (msg->datalen != 5) goto bad12;
+	siz = msg->data[4];
+
+	if ((siz == 0) || (siz > 251)) goto bad12;
 
 	addr = reconst_24(&msg->data[1]);
 
@@ -510,6 +1303,53 @@ bad12:
 	return;
 }
 
+#ifdef NPK_SCATTER
+/* scatter read, i.e. ReadMemByAddress with more than one <AH> <AM> <AL> <SIZ> tuple.
+ * The data of all tuples is concatenated and sent in full frames :
+ * <SID + 0x40> <D0>...<D253> , then a last, shorter frame if required.
+ */
+static void cmd_rmba_scatter(struct iso14230_msg *msg) {
+	const u8 *tuple;
+	unsigned ntuples, idx;
+	unsigned fill;
+
+	ntuples = (msg->datalen - 1) / 4;
+	if ((msg->datalen - 1) % 4) goto bad12;
+
+	for (idx = 0, tuple = &msg->data[1]; idx < ntuples; idx++, tuple += 4) {
+		if ((tuple[3] == 0) || (tuple[3] > 251)) goto bad12;
+	}
+
+	txbuf[0] = SID_RMBA + 0x40;
+	fill = 1;
+	for (idx = 0, tuple = &msg->data[1]; idx < ntuples; idx++, tuple += 4) {
+		u32 addr = reconst_24(tuple);
+		unsigned siz = tuple[3];
+
+		while (siz) {
+			unsigned n = 255 - fill;
+			if (n > siz) n = siz;
+			memcpy(&txbuf[fill], (const void *) addr, n);
+			fill += n;
+			addr += n;
+			siz -= n;
+			if (fill == 255) {
+				iso_sendpkt(txbuf, fill);
+				fill = 1;
+			}
+		}
+	}
+	if (fill > 1) {
+		iso_sendpkt(txbuf, fill);
+	}
+	return;
+
+bad12:
+	tx_7F(SID_RMBA, ISO_NRC_SFNS_IF);
+	return;
+}
+#endif
+
 
 /* WriteMemByAddr - RAM only */
 static void cmd_wmba(struct iso14230_msg *msg) {
@@ -549,17 +1389,739 @@ badexit:
 	return;
 }
 
+#ifdef NPK_SEARCH
+/* masked pattern search. data is the first byte after SID_CONF_SEARCH,
+ * see iso_cmds.h for format.
+ * ret 0 if ok (response sent)
+ */
+static int cmd_search(const u8 *data, unsigned dlen) {
+	u32 addr, len, npos;
+	unsigned align, maxhits, plen, nhits, idx;
+	u8 pat[SID_CONF_SEARCH_MAXPLEN];
+	const u8 *mask;
+
+	if (dlen < 9) return -1;
+	addr = reconst_24(&data[0]);
+	len = (data[3] << 16) | (data[4] << 8) | data[5];
+	align = data[6];
+	maxhits = data[7];
+	plen = data[8];
+
+	if ((plen == 0) || (plen > SID_CONF_SEARCH_MAXPLEN) ||
+		(dlen != (9 + (2 * plen))) ||
+		(align == 0) || (align & (align - 1))) {
+		return -1;
+	}
+	if ((maxhits == 0) || (maxhits > SID_CONF_SEARCH_MAXHITS)) {
+		maxhits = SID_CONF_SEARCH_MAXHITS;
+	}
+
+	mask = &data[9 + plen];
+	for (idx = 0; idx < plen; idx++) {
+		pat[idx] = data[9 + idx] & mask[idx];
+	}
+
+	/* round start up to alignment, then count candidate positions; avoids wrapping at the top of RAM */
+	npos = ((addr + align - 1) & ~(align - 1)) - addr;
+	if (len < (npos + plen)) {
+		npos = 0;
+	} else {
+		len -= npos;
+		addr += npos;
+		npos = ((len - plen) / align) + 1;
+	}
+
+	nhits = 0;
+	for (; npos; npos--, addr += align) {
+		const u8 *cur = (const u8 *) addr;
+
+		if (!(npos % SID_ABORT_CHUNK) && abort_poll(0)) {
+			tx_7F(SID_CONF, NPK_NRC_ABORTED);
+			return 0;
+		}
+		if ((cur[0] & mask[0]) != pat[0]) continue;
+		for (idx = 1; idx < plen; idx++) {
+			if ((cur[idx] & mask[idx]) != pat[idx]) break;
+		}
+		if (idx != plen) continue;
+
+		txbuf[2 + (nhits * 3)] = addr >> 16;
+		txbuf[3 + (nhits * 3)] = addr >> 8;
+		txbuf[4 + (nhits * 3)] = addr & 0xFF;
+		nhits += 1;
+		if (nhits == maxhits) break;
+	}
+
+	txbuf[0] = SID_CONF + 0x40;
+	txbuf[1] = nhits;
+	iso_sendpkt(txbuf, 2 + (nhits * 3));
+	return 0;
+}
+#endif
+
+#ifdef NPK_VERIFY
+/* streaming verify state, see SID_CONF_VFSTART */
+static struct {
+	u32 start;
+	u32 len;
+	u32 next;	//expected offset of next data frame
+	bool bad;	//sequence error, or VFSTART not received
+	u8 map[SID_VF_MAXPAGES / 8];	//mismatched pages
+} vfstate = { .bad = 1 };
+
+static int cmd_vfstart(const u8 *data, unsigned dlen) {
+	u32 addr, len;
+
+	if (dlen != 6) return -1;
+	addr = reconst_24(&data[0]);
+	len = (data[3] << 16) | (data[4] << 8) | data[5];
+	if ((addr % SID_VF_PAGESIZE) || (len == 0) || (len > SID_VF_MAXLEN)) return -1;
+
+	vfstate.start = addr;
+	vfstate.len = len;
+	vfstate.next = 0;
+	vfstate.bad = 0;
+	memset(vfstate.map, 0, sizeof(vfstate.map));
+	return 0;
+}
+
+/** ret 1 if a[] and b[] differ; both must have the same alignment modulo 4.
+ * The bulk is compared with 32-bit loads.
+ */
+static bool vf_differs(const u8 *a, const u8 *b, u32 n) {
+	for (; n && ((u32) a & 3); n--) {
+		if (*a++ != *b++) return 1;
+	}
+	for (; n >= 4; n -= 4, a += 4, b += 4) {
+		if (*(const u32 *) a != *(const u32 *) b) return 1;
+	}
+	for (; n; n--) {
+		if (*a++ != *b++) return 1;
+	}
+	return 0;
+}
+
+/* compare one data frame; sends nothing.
+ * The payload is first copied to txbuf (unused here) so that it has the same alignment as
+ * the memory it's compared with : msg->data is never word-aligned at the payload.
+ */
+static void cmd_vfdata(const u8 *data, unsigned dlen) {
+	u32 ofs;
+	u8 *abuf;
+
+	if (vfstate.bad) return;
+	if (dlen <= 3) {
+		vfstate.bad = 1;
+		return;
+	}
+	ofs = (data[0] << 16) | (data[1] << 8) | data[2];
+	data += 3;
+	dlen -= 3;
+	if ((ofs != vfstate.next) || ((ofs + dlen) > vfstate.len)) {
+		vfstate.bad = 1;
+		return;
+	}
+	vfstate.next += dlen;
+
+	abuf = &txbuf[(vfstate.start + ofs) & 3];	//dlen <= 252 : fits
+	memcpy(abuf, data, dlen);
+	data = abuf;
+
+	/* compare page by page; skip pages already known bad */
+	while (dlen) {
+		unsigned page = ofs / SID_VF_PAGESIZE;
+		u32 n = SID_VF_PAGESIZE - (ofs % SID_VF_PAGESIZE);
+		u8 pbit = 0x80 >> (page % 8);
+
+		if (n > dlen) n = dlen;
+		if (!(vfstate.map[page / 8] & pbit) &&
+			vf_differs((const u8 *) (vfstate.start + ofs), data, n)) {
+			vfstate.map[page / 8] |= pbit;
+		}
+		ofs += n;
+		data += n;
+		dlen -= n;
+	}
+	return;
+}
+
+static void cmd_vfend(void) {
+	unsigned npages;
+
+	if (vfstate.bad || (vfstate.next != vfstate.len)) {
+		vfstate.bad = 1;
+		tx_7F(SID_CONF, ISO_NRC_CNCORSE);
+		return;
+	}
+	vfstate.bad = 1;	//need a new VFSTART
+
+	npages = (vfstate.len + SID_VF_PAGESIZE - 1) / SID_VF_PAGESIZE;
+	txbuf[0] = SID_CONF + 0x40;
+	txbuf[1] = npages >> 8;
+	txbuf[2] = npages & 0xFF;
+	memcpy(&txbuf[3], vfstate.map, (npages + 7) / 8);
+	iso_sendpkt(txbuf, 3 + ((npages + 7) / 8));
+	return;
+}
+#endif
+
+#ifdef NPK_SCRIPT
+/** bytes taken by each script opcode, including the opcode itself. 0 = invalid */
+static const u8 scr_oplen[SCR_NUMOPS] = {
+	[SCR_END] = 1,
+	[SCR_EB] = 2,
+	[SCR_WB] = 9,
+	[SCR_CRC] = 9,
+	[SCR_CMP] = 10,
+	[SCR_BF] = 3,
+	[SCR_FAIL] = 2,
+};
+
+/** run script, see SID_CONF_RUNSCRIPT.
+ * @param pc : set to the offset of the last op executed
+ * @return 0 if SCR_END was reached, or an NRC
+ */
+static u32 script_run(const u8 *script, unsigned slen, unsigned *pc) {
+	unsigned cur = 0;
+	u32 rv = 0;
+
+	while (1) {
+		const u8 *op = &script[cur];
+		u32 a, b, len;
+
+		if ((cur >= slen) || (op[0] >= SCR_NUMOPS) ||
+			(scr_oplen[op[0]] == 0) ||
+			((cur + scr_oplen[op[0]]) > slen)) {
+			rv = ISO_NRC_SFNS_IF;
+			break;
+		}
+		*pc = cur;
+
+		if (op[0] == SCR_BF) {
+			if (rv) {
+				cur = (op[1] << 8) | op[2];
+				rv = 0;
+			} else {
+				cur += scr_oplen[SCR_BF];
+			}
+			continue;
+		}
+
+		/* previous op failed and isn't followed by a branch */
+		if (rv) break;
+
+		if (abort_poll(0)) {
+			rv = NPK_NRC_ABORTED;
+			break;
+		}
+
+		switch (op[0]) {
+		case SCR_END:
+			return 0;
+			break;
+		case SCR_EB:
+			if (flashstate != FL_READY) {
+				rv = ISO_NRC_CNCORSE;
+				break;
+			}
+			rv = flash_eb(op[1]);
+			break;
+		case SCR_WB:
+			a = reconst_24(&op[1]);
+			b = reconst_24(&op[4]);
+			len = (op[7] << 8) | op[8];
+			if (flashstate != FL_READY) {
+				rv = ISO_NRC_CNCORSE;
+				break;
+			}
+			//staging area must be entirely in RAM. Careful, RAM_MAX is 0xFFFFFFFF on 7051
+			if (	(len == 0) ||
+				(b < RAM_MIN) ||
+				(b > RAM_MAX) ||
+				(len > (RAM_MAX - b + 1))) {
+				rv = ISO_NRC_CNDTSA;
+				break;
+			}
+			//and the destination entirely in flash, whole pages
+			a &= 0xFFFFFF;
+			if (	(a > FL_MAXROM) ||
+				(len > (FL_MAXROM - a + 1)) ||
+				(len % SIDFL_WB_DLEN)) {
+				rv = ISO_NRC_CNDTSA;
+				break;
+			}
+			rv = flash_wb(a, b, len);
+			break;
+		case SCR_CRC:
+			a = reconst_24(&op[1]);
+			len = (op[4] << 16) | (op[5] << 8) | op[6];
+			if (crc16((const u8 *) a, len) != ((op[7] << 8) | op[8])) {
+				rv = SID_CONF_CKS1_BADCKS;
+			}
+			break;
+		case SCR_CMP:
+			a = reconst_24(&op[1]);
+			b = reconst_24(&op[4]);
+			len = (op[7] << 16) | (op[8] << 8) | op[9];
+			if (memcmp((const void *) a, (const void *) b, len)) {
+				rv = SID_CONF_CKS1_BADCKS;
+			}
+			break;
+		case SCR_FAIL:
+			return op[1];
+			break;
+		default:
+			break;
+		}
+		cur += scr_oplen[op[0]];
+	}
+
+	return rv;
+}
+#endif
+
+#ifdef NPK_BENCH
+/** run the SID_CONF_BENCH tests, see iso_cmds.h. Uses txbuf as scratch */
+static void cmd_bench(void) {
+	u32 res[SID_BENCH_NUM];
+	/* flash starts at address 0; take it from fblocks so the compiler never sees a null pointer */
+	const u8 *rom = (const u8 *) fblocks[0];
+	volatile u32 sink;
+	u32 t0, cur, acc;
+	unsigned idx;
+
+	t0 = get_mclk_ts();
+	sink = crc16(rom, SID_BENCH_LEN);
+	res[SID_BENCH_CRC16] = get_mclk_ts() - t0;
+
+	t0 = get_mclk_ts();
+	for (cur = 0; cur < SID_BENCH_LEN; cur += 256) {
+		memcpy(txbuf, &rom[cur], 256);
+	}
+	res[SID_BENCH_MEMCPY] = get_mclk_ts() - t0;
+
+	t0 = get_mclk_ts();
+	for (cur = 0, acc = 0; cur < SID_BENCH_LEN; cur += 4) {
+		if (*(const u32 *) &rom[cur] != 0xFFFFFFFF) acc++;
+	}
+	res[SID_BENCH_BLANK] = get_mclk_ts() - t0;
+	sink = acc;
+
+	t0 = get_mclk_ts();
+	sink = cks_u8(rom, SID_BENCH_LEN);
+	res[SID_BENCH_CKSU8] = get_mclk_ts() - t0;
+
+	/* with TE cleared and tx_dry set, iso_sendpkt() runs without waiting on the line */
+	while (!NPK_SCI.SSR.BIT.TEND) {}
+	NPK_SCI.SCR.BIT.TE = 0;
+	tx_dry = 1;
+	t0 = get_mclk_ts();
+	for (cur = 0; cur < SID_BENCH_LEN; cur += 256) {
+		iso_sendpkt(&rom[cur], 255);
+	}
+	res[SID_BENCH_TX] = get_mclk_ts() - t0;
+	tx_dry = 0;
+	NPK_SCI.SCR.BIT.TE = 1;
+
+	res[SID_BENCH_LZPACK] = (u32) -1;
+#ifdef NPK_ROMZ
+	if (LZ_READY()) {
+		t0 = get_mclk_ts();
+		for (cur = 0; cur < SID_BENCH_LEN; ) {
+			u32 plen, in;
+
+			in = SID_BENCH_LEN - cur;
+			if (in > SID_DUMPZ_MAXIN) in = SID_DUMPZ_MAXIN;
+			cur += LZ_PACK(&rom[cur], in, txbuf, sizeof(txbuf), &plen);
+		}
+		res[SID_BENCH_LZPACK] = get_mclk_ts() - t0;
+	}
+#endif
+
+	res[SID_BENCH_CRC32] = (u32) -1;
+#ifdef NPK_CKSUM
+	sink = crc32(rom, 4);	//don't count the table setup
+	t0 = get_mclk_ts();
+	sink = crc32(rom, SID_BENCH_LEN);
+	res[SID_BENCH_CRC32] = get_mclk_ts() - t0;
+#endif
+	(void) sink;
+
+	txbuf[0] = SID_CONF + 0x40;
+	for (idx = 0; idx < SID_BENCH_NUM; idx++) {
+		txbuf[1 + (idx * 4)] = res[idx] >> 24;
+		txbuf[2 + (idx * 4)] = res[idx] >> 16;
+		txbuf[3 + (idx * 4)] = res[idx] >> 8;
+		txbuf[4 + (idx * 4)] = res[idx];
+	}
+	iso_sendpkt(txbuf, 1 + (SID_BENCH_NUM * 4));
+}
+#endif
+
+#ifdef NPK_ARENA
+/** write <N> N * (<A2A1A0> <L2L1L0>) for the free arena regions
+ * @return updated pointer
+ */
+static u8 *put_arena(u8 *pt) {
+	const struct arena_rgn *rgn;
+	unsigned idx, n;
+	u8 *pn = pt++;
+
+	n = arena_get(&rgn);
+	*pn = 0;
+	for (idx = 0; idx < n; idx++) {
+		u32 len = rgn[idx].last - rgn[idx].start + 1;
+		if ((rgn[idx].start > rgn[idx].last) || (len == 0)) continue;	//used up by arena_alloc()
+		*pn += 1;
+		*pt++ = rgn[idx].start >> 16;
+		*pt++ = rgn[idx].start >> 8;
+		*pt++ = rgn[idx].start;
+		*pt++ = len >> 16;
+		*pt++ = len >> 8;
+		*pt++ = len;
+	}
+	return pt;
+}
+#endif
+
+#ifdef NPK_CAPS
+/** write the <nb> low bytes of val, big-endian
+ * @return updated pointer
+ */
+static u8 *put_be(u8 *pt, u32 val, unsigned nb) {
+	while (nb) {
+		nb -= 1;
+		*pt++ = val >> (8 * nb);
+	}
+	return pt;
+}
+
+/* SID_CAP_SIDS tables; must be kept in sync with cmd_loop() and the subcommand parsers.
+ * SIDs without subcommands first; the others are appended from their subcommand lists */
+static const u8 caps_sids[] = {
+	SID_RECUID, 0,
+	SID_RMBA, 0,
+	SID_WMBA, 0,
+	SID_TP, 0,
+	SID_RESET, 0,
+	SID_FLREQ, 0,
+	SID_STARTCOMM, 0,
+};
+
+#ifdef NPK_ATP
+static const u8 caps_atp[] = {SID_ATP_LIMITS, SID_ATP_DEFAULTS, SID_ATP_CURRENT, SID_ATP_SET};
+#endif
+
+static const u8 caps_dump[] = {
+	SID_DUMP_EEPROM, SID_DUMP_ROM,
+#ifdef NPK_ROMZ
+	SID_DUMP_ROMZ,
+#endif
+#ifdef NPK_DUMPDIFF
+	SID_DUMP_DIFF,
+#endif
+};
+
+static const u8 caps_flash[] = {
+	SIDFL_UNPROTECT, SIDFL_EB, SIDFL_WB,
+#ifdef NPK_FLWR
+	SIDFL_WR, SIDFL_WRS,
+#endif
+#ifdef NPK_FLCPY
+	SIDFL_CPY,
+#endif
+	SIDFL_EBP,
+};
+
+static const u8 caps_conf[] = {
+	SID_CONF_SETSPEED, SID_CONF_SETEEPR, SID_CONF_CKS1,
+#ifdef NPK_EEPWIRE
+	SID_CONF_EEPWIRE,
+#endif
+#ifdef NPK_SEARCH
+	SID_CONF_SEARCH,
+#endif
+#ifdef NPK_CKSUM
+	SID_CONF_CKSUM,
+#endif
+#ifdef NPK_VERIFY
+	SID_CONF_VFSTART, SID_CONF_VFDATA, SID_CONF_VFEND,
+#endif
+#ifdef NPK_SCRIPT
+	SID_CONF_RUNSCRIPT,
+#endif
+#ifdef NPK_ARENA
+	SID_CONF_ARENA,
+#endif
+#ifdef NPK_BENCH
+	SID_CONF_BENCH,
+#endif
+#ifdef NPK_AUTOBAUD
+	SID_CONF_AUTOBAUD,
+#endif
+#ifdef NPK_LINKSTAT
+	SID_CONF_LINKSTAT,
+#endif
+	SID_CONF_CAPS,
+#ifdef NPK_STREAM
+	SID_CONF_STREAM,
+#endif
+#ifdef NPK_OVERLAYS
+	SID_CONF_OVLOAD,
+#endif
+#ifdef DIAG_U16READ
+	SID_CONF_R16,
+#endif
+#ifdef NPK_TRACE
+	SID_CONF_TRACE,
+#endif
+};
+
+/** start a TLV field; the length is filled by caps_tlvend() */
+static u8 *caps_tlv(u8 *pt, u8 type) {
+	*pt++ = type;
+	return pt + 1;
+}
+
+static u8 *caps_tlvend(u8 *start, u8 *pt) {
+	start[1] = pt - start - 2;
+	return pt;
+}
+
+/** write <SID> <NS> <SUB0>...<SUB(NS-1)> for SID_CAP_SIDS */
+static u8 *caps_putsid(u8 *pt, u8 sid, const u8 *subs, unsigned ns) {
+	*pt++ = sid;
+	*pt++ = ns;
+	memcpy(pt, subs, ns);
+	return pt + ns;
+}
+
+/** SID_CONF_CAPS : build the capability descriptor in txbuf.
+ * Worst case is ~210 bytes (SH7058 : 17 blocks + 6 arena regions), no bounds checks needed.
+ */
+static void cmd_caps(void) {
+	u8 *pt = txbuf;
+	u8 *tlv;
+	unsigned idx;
+
+	*pt++ = SID_CONF + 0x40;
+
+	tlv = pt;
+	pt = caps_tlv(pt, SID_CAP_VER);
+	memcpy(pt, &npk_ver_string[1], sizeof(npk_ver_string) - 2);	//skip SID_RECUID_PRC and the 0 terminator
+	pt = caps_tlvend(tlv, pt + sizeof(npk_ver_string) - 2);
+
+	tlv = pt;
+	pt = caps_tlv(pt, SID_CAP_PLATF);
+	memcpy(pt, PLATF, sizeof(PLATF) - 1);
+	pt = caps_tlvend(tlv, pt + sizeof(PLATF) - 1);
+
+	tlv = pt;
+	pt = caps_tlv(pt, SID_CAP_FBLOCKS);
+	idx = 0;
+	do {
+		pt = put_be(pt, fblocks[idx], 3);
+	} while (fblocks[idx++] <= FL_MAXROM);
+	pt = caps_tlvend(tlv, pt);
+
+	tlv = pt;
+	pt = caps_tlv(pt, SID_CAP_MAXROM);
+	pt = caps_tlvend(tlv, put_be(pt, FL_MAXROM, 3));
+
+	tlv = pt;
+	pt = caps_tlv(pt, SID_CAP_RAM);
+	pt = put_be(pt, RAM_MIN, 4);
+	pt = caps_tlvend(tlv, put_be(pt, RAM_MAX, 4));
+
+#ifdef NPK_ARENA
+	tlv = pt;
+	pt = caps_tlv(pt, SID_CAP_ARENA);
+	pt = caps_tlvend(tlv, put_arena(pt));
+#endif
+
+	tlv = pt;
+	pt = caps_tlv(pt, SID_CAP_SIDS);
+	memcpy(pt, caps_sids, sizeof(caps_sids));
+	pt += sizeof(caps_sids);
+#ifdef NPK_ATP
+	pt = caps_putsid(pt, SID_ATP, caps_atp, sizeof(caps_atp));
+#endif
+	pt = caps_putsid(pt, SID_DUMP, caps_dump, sizeof(caps_dump));
+	pt = caps_putsid(pt, SID_FLASH, caps_flash, sizeof(caps_flash));
+	pt = caps_putsid(pt, SID_CONF, caps_conf, sizeof(caps_conf));
+	pt = caps_tlvend(tlv, pt);
+
+	tlv = pt;
+	pt = caps_tlv(pt, SID_CAP_MAXPL);
+	*pt++ = 0xFF;
+	*pt++ = 0xFF;
+	pt = caps_tlvend(tlv, pt);
+
+	tlv = pt;
+	pt = caps_tlv(pt, SID_CAP_SCI);
+	pt = put_be(pt, SID_CAP_SCI_BASE, 4);
+	*pt++ = NPK_SCI.SMR.BIT.CKS;
+	*pt++ = NPK_SCI.BRR;
+#ifdef NPK_AUTOBAUD
+	*pt++ = SID_CAP_SCI_AUTOBAUD;
+#else
+	*pt++ = 0;
+#endif
+	pt = caps_tlvend(tlv, pt);
+
+	iso_sendpkt(txbuf, pt - txbuf);
+}
+#endif
+
+#ifdef NPK_STREAM
+/** stream out [addr, addr + len) for SID_CONF_STREAM, with a crc16 after every chunk of intv bytes
+ * @param done : set to the # of bytes sent along with their CRC
+ * @return SID_STREAM_* status
+ */
+static u8 stream_down(u32 addr, u32 len, u32 intv, u32 *done) {
+	NPK_SCI.SCR.BIT.RE = 0;
+#ifdef NPK_ATP
+	tx_started = 0;
+#endif
+	while (len) {
+		u32 n = (len > intv) ? intv : len;
+		u16 crc = crc16((const u8 *) addr, n);
+		u8 ck[2];
+
+		sci_txblock((const u8 *) addr, n);
+		ck[0] = crc >> 8;
+		ck[1] = crc & 0xFF;
+		sci_txblock(ck, 2);
+		addr += n;
+		len -= n;
+		*done += n;
+
+		if (len) {
+			//give the host a chance to abort
+			while (!NPK_SCI.SSR.BIT.TEND) {}
+			NPK_SCI.SCR.BIT.RE = 1;
+			if (abort_poll(1)) return SID_STREAM_ABORTED;
+			NPK_SCI.SCR.BIT.RE = 0;
+		}
+	}
+	while (!NPK_SCI.SSR.BIT.TEND) {}
+	NPK_SCI.SCR.BIT.RE = 1;
+	return SID_STREAM_OK;
+}
+
+/** receive one raw byte for stream_up()
+ * @return SID_STREAM_* status
+ */
+static u8 stream_rxbyte(u8 *b) {
+	u32 t0 = get_mclk_ts();
+
+	while (!NPK_SCI.SSR.BIT.RDRF) {
+		if (NPK_SCI.SSR.BYTE & 0x38) return SID_STREAM_RXERR;
+		if ((u32) (get_mclk_ts() - t0) > MCLK_GETTS(SID_STREAM_TMO)) return SID_STREAM_TIMEOUT;
+	}
+	if (NPK_SCI.SSR.BYTE & 0x38) return SID_STREAM_RXERR;
+	*b = NPK_SCI.RDR;
+	NPK_SCI.SSR.BIT.RDRF = 0;
+	return SID_STREAM_OK;
+}
+
+/** receive a stream into RAM at [addr, addr + len) for SID_CONF_STREAM
+ * The CRC is updated as bytes come in, so there's no pause at checkpoints.
+ * @param done : set to the # of bytes received with a valid CRC
+ * @return SID_STREAM_* status
+ */
+static u8 stream_up(u32 addr, u32 len, u32 intv, u32 *done) {
+	u8 *dst = (u8 *) addr;
+	u8 rv;
+
+	while (len) {
+		u32 n = (len > intv) ? intv : len;
+		u32 idx;
+		u16 crc = 0;
+		u8 ck[2];
+
+		for (idx = 0; idx < n; idx++) {
+			rv = stream_rxbyte(&dst[idx]);
+			if (rv) goto fail;
+			crc = crc16_upd(crc, &dst[idx], 1);
+		}
+		for (idx = 0; idx < 2; idx++) {
+			rv = stream_rxbyte(&ck[idx]);
+			if (rv) goto fail;
+		}
+		if (crc != ((ck[0] << 8) | ck[1])) {
+			rv = SID_STREAM_BADCRC;
+			goto fail;
+		}
+		dst += n;
+		len -= n;
+		*done += n;
+	}
+	return SID_STREAM_OK;
+
+fail:
+	//wait until the host is done
+	sci_rxidle(MAX_INTERBYTE);
+	return rv;
+}
+
+/* raw streaming transfer. args is the first byte after SID_CONF_STREAM
+ * ret 0 if ok (status frame sent)
+ */
+static int cmd_stream(const u8 *args, unsigned nargs) {
+	u32 addr, len, intv, done = 0;
+	u8 dir, rv;
+
+	if (nargs != 9) return -1;
+	dir = args[0];
+	addr = reconst_24(&args[1]);
+	len = (args[4] << 16) | (args[5] << 8) | args[6];
+	intv = (args[7] << 8) | args[8];
+	if ((len == 0) || (dir > SID_STREAM_UP)) return -1;
+	if ((intv == 0) || (intv > len)) intv = len;
+
+	if (dir == SID_STREAM_UP) {
+		if (	(addr < RAM_MIN) ||
+			(addr > RAM_MAX) ||
+			(len > (RAM_MAX - addr + 1))) {
+			tx_7F(SID_CONF, ISO_NRC_CNDTSA);
+			return 0;
+		}
+	}
+
+	txbuf[0] = SID_CONF + 0x40;
+	txbuf[1] = SID_CONF_STREAM;
+	iso_sendpkt(txbuf, 2);
+
+	if (dir == SID_STREAM_UP) {
+		rv = stream_up(addr, len, intv, &done);
+	} else {
+		rv = stream_down(addr, len, intv, &done);
+	}
+
+	txbuf[0] = SID_CONF + 0x40;
+	txbuf[1] = SID_CONF_STREAM;
+	txbuf[2] = rv;
+	txbuf[3] = done >> 16;
+	txbuf[4] = done >> 8;
+	txbuf[5] = done & 0xFF;
+	iso_sendpkt(txbuf, 6);
+	return 0;
+}
+#endif
+
 /* set & configure kernel */
 static void cmd_conf(struct iso14230_msg *msg) {
 	u8 resp[4];
 	u32 tmp;
 
 	resp[0] = SID_CONF + 0x40;
-	if (msg->datalen < 3) goto bad12;
+	if (msg->datalen < 2) goto bad12;
 
 	switch (msg->data[1]) {
 	case SID_CONF_SETSPEED:
 		/* set comm speed (BRR divisor reg) : <SID_CONF> <SID_CONF_SETSPEED> <new divisor> */
+		if (msg->datalen < 3) goto bad12;
 		iso_sendpkt(resp, 1);
 		cmd_init(msg->data[2]);
 		sci_rxidle(25);
@@ -573,6 +2135,198 @@ static void cmd_conf(struct iso14230_msg *msg) {
 		iso_sendpkt(resp, 1);
 		return;
 		break;
+#ifdef NPK_EEPWIRE
+	case SID_CONF_EEPWIRE:
+		{
+		struct eep_pin pins[EEP_NPINS];
+		unsigned idx;
+		//<SID_CONF> <SID_CONF_EEPWIRE> <ABITS> 4 * <PxDR_H> <PxDR_L> <BIT#>
+		if (msg->datalen != (3 + (EEP_NPINS * 3))) goto bad12;
+		for (idx = 0; idx < EEP_NPINS; idx++) {
+			const u8 *pdesc = &msg->data[3 + (idx * 3)];
+			pins[idx].dr = (volatile u16 *) (0xFFFF0000 | (pdesc[0] << 8) | pdesc[1]);
+			pins[idx].mask = (pdesc[2] < 16) ? (1 << pdesc[2]) : 0;
+		}
+		if (!eep_setwire(msg->data[2], pins)) goto bad12;
+		iso_sendpkt(resp, 1);
+		return;
+		break;
+		}
+#endif
+#ifdef NPK_SEARCH
+	case SID_CONF_SEARCH:
+		if (cmd_search(&msg->data[2], msg->datalen - 2)) goto bad12;
+		return;
+		break;
+#endif
+#ifdef NPK_CKSUM
+	case SID_CONF_CKSUM:
+		if (cmd_cksum(&msg->data[2], msg->datalen - 2)) goto bad12;
+		return;
+		break;
+#endif
+#ifdef NPK_VERIFY
+	case SID_CONF_VFSTART:
+		if (cmd_vfstart(&msg->data[2], msg->datalen - 2)) goto bad12;
+		iso_sendpkt(resp, 1);
+		return;
+		break;
+	case SID_CONF_VFDATA:
+		cmd_vfdata(&msg->data[2], msg->datalen - 2);
+		return;
+		break;
+	case SID_CONF_VFEND:
+		cmd_vfend();
+		return;
+		break;
+#endif
+#ifdef NPK_SCRIPT
+	case SID_CONF_RUNSCRIPT:
+		{
+		unsigned slen, pc = 0;
+		//<SID_CONF> <SID_CONF_RUNSCRIPT> <A2> <A1> <A0> <LH> <LL>
+		if (msg->datalen != 7) goto bad12;
+		tmp = reconst_24(&msg->data[2]);
+		slen = (msg->data[5] << 8) | msg->data[6];
+		if ((slen == 0) || (tmp < RAM_MIN) || (slen > (RAM_MAX - tmp + 1))) {
+			tx_7F(SID_CONF, ISO_NRC_CNDTSA);
+			return;
+		}
+		tmp = script_run((const u8 *) tmp, slen, &pc);
+		txbuf[0] = SID_CONF + 0x40;
+		txbuf[1] = tmp;
+		txbuf[2] = pc >> 8;
+		txbuf[3] = pc & 0xFF;
+		iso_sendpkt(txbuf, 4);
+		return;
+		break;
+		}
+#endif
+#ifdef NPK_ARENA
+	case SID_CONF_ARENA:
+		txbuf[0] = SID_CONF + 0x40;
+		iso_sendpkt(txbuf, put_arena(&txbuf[1]) - txbuf);
+		return;
+		break;
+#endif
+#ifdef NPK_STREAM
+	case SID_CONF_STREAM:
+		if (cmd_stream(&msg->data[2], msg->datalen - 2)) goto bad12;
+		return;
+		break;
+#endif
+#ifdef NPK_CAPS
+	case SID_CONF_CAPS:
+		if (msg->datalen != 2) goto bad12;
+		cmd_caps();
+		return;
+		break;
+#endif
+#ifdef NPK_AUTOBAUD
+	case SID_CONF_AUTOBAUD:
+		{
+		volatile const u16 *dr;
+		u32 span;
+		//<SID_CONF> <SID_CONF_AUTOBAUD> <PxDR_H> <PxDR_L> <BIT#>
+		if ((msg->datalen != 5) || (msg->data[4] > 15)) goto bad12;
+		dr = (volatile const u16 *) (0xFFFF0000 | (msg->data[2] << 8) | msg->data[3]);
+		iso_sendpkt(resp, 1);
+		span = autobaud_measure(dr, 1 << msg->data[4]);
+		if (!span || !autobaud_set(span)) {
+			//no luck : stay at the current speed
+			sci_rxidle(25);
+			NPK_SCI.SSR.BYTE &= 0x87;
+			return;
+		}
+		sci_rxidle(25);
+		return;
+		break;
+		}
+#endif
+#ifdef NPK_TRACE
+	case SID_CONF_TRACE:
+		//<SID_CONF> <SID_CONF_TRACE> <MODE>
+		if (msg->datalen != 3) goto bad12;
+		switch (msg->data[2]) {
+		case SID_TRACE_INFO:
+			break;
+		case SID_TRACE_CLEAR:
+			trace_buf.idx = 0;
+			trace_buf.flags = 0;
+			break;
+		case SID_TRACE_FREEZE:
+			trace_buf.flags |= SID_TRACE_FROZEN;
+			break;
+		default:
+			goto bad12;
+		}
+		tmp = (u32) trace_buf.ring;
+		txbuf[0] = SID_CONF + 0x40;
+		txbuf[1] = tmp >> 24;
+		txbuf[2] = tmp >> 16;
+		txbuf[3] = tmp >> 8;
+		txbuf[4] = tmp;
+		txbuf[5] = NPK_TRACE_NENT >> 8;
+		txbuf[6] = NPK_TRACE_NENT & 0xFF;
+		txbuf[7] = trace_buf.idx >> 8;
+		txbuf[8] = trace_buf.idx & 0xFF;
+		txbuf[9] = trace_buf.flags;
+		iso_sendpkt(txbuf, 10);
+		return;
+		break;
+#endif
+#ifdef NPK_LINKSTAT
+	case SID_CONF_LINKSTAT:
+		{
+		unsigned idx;
+		//<SID_CONF> <SID_CONF_LINKSTAT> [<CLR>]
+		if ((msg->datalen != 2) && (msg->datalen != 3)) goto bad12;
+		txbuf[0] = SID_CONF + 0x40;
+		for (idx = 0; idx < SID_LINKSTAT_NUM; idx++) {
+			txbuf[1 + 2 * idx] = linkstat[idx] >> 8;
+			txbuf[2 + 2 * idx] = linkstat[idx];
+		}
+		if ((msg->datalen == 3) && msg->data[2]) {
+			memset(linkstat, 0, sizeof(linkstat));
+		}
+		iso_sendpkt(txbuf, 1 + 2 * SID_LINKSTAT_NUM);
+		return;
+		break;
+		}
+#endif
+#ifdef NPK_BENCH
+	case SID_CONF_BENCH:
+		if (msg->datalen != 2) goto bad12;
+		cmd_bench();
+		return;
+		break;
+#endif
+#ifdef NPK_OVERLAYS
+	case SID_CONF_OVLOAD:
+		//<SID_CONF> <SID_CONF_OVLOAD> [<S2> <S1> <S0> <LH> <LL> <CRCH> <CRCL>]
+		if (msg->datalen == 9) {
+			tmp = ovl_load(reconst_24(&msg->data[2]), (msg->data[5] << 8) | msg->data[6],
+					(msg->data[7] << 8) | msg->data[8]);
+			if (tmp) {
+				tx_7F(SID_CONF, tmp);
+				return;
+			}
+		} else if (msg->datalen != 2) {
+			goto bad12;
+		}
+		tmp = ovl_end - ovl_start;
+		txbuf[0] = SID_CONF + 0x40;
+		txbuf[1] = ovl_getactive();
+		txbuf[2] = (u32) ovl_start >> 16;
+		txbuf[3] = (u32) ovl_start >> 8;
+		txbuf[4] = (u32) ovl_start;
+		txbuf[5] = tmp >> 16;
+		txbuf[6] = tmp >> 8;
+		txbuf[7] = tmp;
+		iso_sendpkt(txbuf, 8);
+		return;
+		break;
+#endif
 	case SID_CONF_CKS1:
 		//<SID_CONF> <SID_CONF_CKS1> <CNH> <CNL> <CRC0H> <CRC0L> ...<CRC3H> <CRC3L>
 		if (msg->datalen != 12) {
@@ -590,6 +2344,7 @@ static void cmd_conf(struct iso14230_msg *msg) {
 		{
 		u16 val;
 		//<SID_CONF> <SID_CONF_R16> <A2> <A1> <A0>
+		if (msg->datalen != 5) goto bad12;
 		tmp = reconst_24(&msg->data[2]);
 		tmp &= ~1;	//clr lower bit of course
 		val = *(const u16 *) tmp;
@@ -625,12 +2380,18 @@ void cmd_loop(void) {
 	//u32 t_last, t_cur;	//timestamps
 
 	iso_clearmsg(&msg);
+	crcmap_init();
 
 	while (1) {
 		enum iso_prc prv;
 
 		/* in case of errors (ORER | FER | PER), reset state mach. */
 		if (NPK_SCI.SSR.BYTE & 0x38) {
+			u8 ssr = NPK_SCI.SSR.BYTE;
+
+			if (ssr & 0x20) linkstat_inc(SID_LINKSTAT_ORER);
+			if (ssr & 0x10) linkstat_inc(SID_LINKSTAT_FER);
+			if (ssr & 0x08) linkstat_inc(SID_LINKSTAT_PER);
 
 			cmstate = CM_IDLE;
 			flashstate = FL_IDLE;
@@ -639,7 +2400,11 @@ void cmd_loop(void) {
 			continue;
 		}
 
-		if (!NPK_SCI.SSR.BIT.RDRF) continue;
+		if (!NPK_SCI.SSR.BIT.RDRF) {
+			//not inside a frame : use the time to fill the crc cache
+			if (msg.hi == 0) crcmap_idle();
+			continue;
+		}
 
 		rxbyte = NPK_SCI.RDR;
 		NPK_SCI.SSR.BIT.RDRF = 0;
@@ -647,17 +2412,23 @@ void cmd_loop(void) {
 		//t_cur = get_mclk_ts();	/* XXX TODO : filter out interrupted messages with t>5ms interbyte ? */
 
 		/* got a byte; parse according to state */
+		if (msg.hi == 0) TRACE_EVT(SID_TRACE_RXSTART, rxbyte, 0);
 		prv = iso_parserx(&msg, rxbyte);
 
 		if (prv == ISO_PRC_NEEDMORE) {
 			continue;
 		}
+		TRACE_EVT(SID_TRACE_RXEND, (prv != ISO_PRC_DONE), msg.datalen);
 		if (prv != ISO_PRC_DONE) {
 			iso_clearmsg(&msg);
 			sci_rxidle(MAX_INTERBYTE);
 			continue;
 		}
 		/* here, we have a complete iso frame */
+#ifdef NPK_ATP
+		t_rxdone = get_mclk_ts();
+#endif
+		TRACE_EVT(SID_TRACE_DISPATCH, msg.data[0], (msg.datalen > 1) ? msg.data[1] : 0);
 
 		switch (cmstate) {
 		case CM_IDLE:
@@ -690,6 +2461,13 @@ void cmd_loop(void) {
 				die();
 				break;
 			case SID_RMBA:
+#ifdef NPK_SCATTER
+				if (msg.datalen > 5) {
+					cmd_rmba_scatter(&msg);
+					iso_clearmsg(&msg);
+					break;
+				}
+#endif
 				cmd_rmba(&msg);
 				iso_clearmsg(&msg);
 				break;
@@ -714,6 +2492,12 @@ void cmd_loop(void) {
 				cmd_flash_init();
 				iso_clearmsg(&msg);
 				break;
+#ifdef NPK_ATP
+			case SID_ATP:
+				cmd_atp(&msg);
+				iso_clearmsg(&msg);
+				break;
+#endif
 			default:
 				tx_7F(msg.data[0], ISO_NRC_SNS);
 				iso_clearmsg(&msg);
@@ -9,6 +9,13 @@
 #define CRC16	0xBAAD	//koopman, 2048bits (256B)
 //#define CRC16	0xa001	//common CRC16 (winhex)
 
+/* CRC32 : reflected, init + final xor 0xFFFFFFFF */
+#define CRC32_POLY	0xEDB88320	//IEEE 802.3 / zlib
+//#define CRC32_POLY	0x82F63B78	//Castagnoli (CRC-32C)
+
+/* Uncomment to use a 16-entry table (64B) instead of 256 entries (1kB of RAM); about twice as slow */
+//#define CRC32_NIBBLE
+
 
 /*** CRC16 implementation adapted from Lammert Bies
  * https://www.lammertbies.nl/comm/info/crc-calculation.html
@@ -38,13 +45,9 @@ static void init_crc16_tab( void ) {
 
 
 /* 12 cy/byte; codesize = 0x78; tablesiz = 512B */
-u16 crc16(const u8 *data, u32 siz) {
-	u16 crc;
-
+u16 crc16_upd(u16 crc, const u8 *data, u32 siz) {
 	if ( ! crc_tab16_init ) init_crc16_tab();
 
-	crc = 0;
-
 	while (siz > 0) {
 		u16 tmp;
 		u8 nextval;
@@ -65,3 +68,110 @@ u16 crc16(const u8 *data, u32 siz) {
 
 	return crc;
 }
+
+u16 crc16(const u8 *data, u32 siz) {
+	return crc16_upd(0, data, siz);
+}
+
+
+/*** CRC32, table built on first use. The bulk of the data is read with aligned 32-bit loads,
+ * which saves 3 of 4 flash accesses vs bytewise. Bytes are fed in memory order for either
+ * endianness (SH is big-endian : first byte in the MSBs), so CRC_HOST below checks the same code.
+ * A slicing-by-4 version would need 4kB of tables, too much RAM for the 7051.
+ */
+#ifdef CRC32_NIBBLE
+	#define CRC32_TABBITS	4
+	#define CRC32_STEP(crc, b) do { \
+			crc ^= (u8) (b); \
+			crc = (crc >> 4) ^ crc_tab32[crc & 0x0F]; \
+			crc = (crc >> 4) ^ crc_tab32[crc & 0x0F]; \
+		} while (0)
+#else
+	#define CRC32_TABBITS	8
+	#define CRC32_STEP(crc, b) crc = (crc >> 8) ^ crc_tab32[(crc ^ (b)) & 0xFF]
+#endif
+
+static bool crc_tab32_init = 0;
+static u32 crc_tab32[1 << CRC32_TABBITS];
+
+static void init_crc32_tab(void) {
+	u32 i, j, crc;
+
+	for (i = 0; i < (1 << CRC32_TABBITS); i++) {
+		crc = i;
+		for (j = 0; j < CRC32_TABBITS; j++) {
+			if (crc & 1) crc = (crc >> 1) ^ CRC32_POLY;
+			else         crc =  crc >> 1;
+		}
+		crc_tab32[i] = crc;
+	}
+
+	crc_tab32_init = 1;
+}
+
+u32 crc32_upd(u32 crc, const u8 *data, u32 siz) {
+	if ( ! crc_tab32_init ) init_crc32_tab();
+
+	crc = ~crc;
+
+	/* leading bytes until aligned */
+	for (; siz && ((uintptr_t) data & 3); siz--) {
+		CRC32_STEP(crc, *data++);
+	}
+
+	for (; siz >= 4; siz -= 4, data += 4) {
+		u32 w = *(const u32 *) data;
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+		CRC32_STEP(crc, w);
+		CRC32_STEP(crc, w >> 8);
+		CRC32_STEP(crc, w >> 16);
+		CRC32_STEP(crc, w >> 24);
+#else
+		CRC32_STEP(crc, w >> 24);
+		CRC32_STEP(crc, w >> 16);
+		CRC32_STEP(crc, w >> 8);
+		CRC32_STEP(crc, w);
+#endif
+	}
+
+	for (; siz; siz--) {
+		CRC32_STEP(crc, *data++);
+	}
+
+	return ~crc;
+}
+
+u32 crc32(const u8 *data, u32 siz) {
+	return crc32_upd(0, data, siz);
+}
+
+
+#ifdef CRC_HOST
+/* Host build, checks crc32() against the standard check value at every alignment / split :
+ *	gcc -O2 -DCRC_HOST -I . -o crctest crc.c
+ *	gcc -O2 -DCRC_HOST -DCRC32_NIBBLE -I . -o crctest crc.c
+ */
+#include <stdio.h>
+#include <string.h>
+
+int main(void) {
+	static const char vec[] = "123456789";
+	u8 buf[4 + sizeof(vec)] __attribute__ ((aligned (4)));
+	unsigned ofs, split;
+	int rv = 0;
+
+	for (ofs = 0; ofs < 4; ofs++) {
+		memcpy(&buf[ofs], vec, 9);
+		for (split = 0; split <= 9; split++) {
+			u32 crc = crc32_upd(crc32(&buf[ofs], split), &buf[ofs + split], 9 - split);
+			if (crc != 0xCBF43926) {
+				printf("ofs %u split %u : got %08lX\n", ofs, split, (unsigned long) crc);
+				rv = 1;
+			}
+		}
+	}
+	printf("crc32 : %s\n", rv ? "FAIL" : "ok");
+	return rv;
+}
+#endif	//CRC_HOST
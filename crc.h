@@ -5,4 +5,15 @@
 
 u16 crc16(const u8 *data, u32 siz);
 
+/** continue a crc16 computation; crc16(data, siz) == crc16_upd(0, data, siz) */
+u16 crc16_upd(u16 crc, const u8 *data, u32 siz);
+
+/** CRC32 (see CRC32_POLY in crc.c) */
+u32 crc32(const u8 *data, u32 siz);
+
+/** continue a crc32 computation, zlib-style : crc32(data, siz) == crc32_upd(0, data, siz),
+ * and crc32_upd(crc32(a, na), b, nb) is the CRC of a followed by b.
+ */
+u32 crc32_upd(u32 crc, const u8 *data, u32 siz);
+
 #endif
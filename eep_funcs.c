@@ -20,14 +20,163 @@
 
 
 
+#include "extra_functions.h"	//imask_savedisable
+#include "platf.h"
+#include "eep_funcs.h"
+
 /* built-in EEPROM read function in stock ROM */
 /* this assumes the compiler ABI matches the stock ROM, i.e. input args in r4, r5 */
 static void (*builtin_eep_read16)(uint8_t addr, uint16_t *dest) = 0;
 
 
-void eep_read16(uint8_t addr, uint16_t *dest) {
+#ifdef NPK_EEPWIRE
+/********** native Microwire (93Cx6) driver
+ *
+ * The stock ROM has already set up the port pins (it reads the EEPROM at boot),
+ * so we only need to know which PxDR bits to use. The parts are used in x16 organisation :
+ * READ = <1> <1 0> <A(n-1)...A0>, then a dummy '0' and D15...D0, and the address auto-increments
+ * as long as CS stays high and SK keeps running (sequential read).
+ */
+
+static struct eep_pin wire_pins[EEP_NPINS];
+static unsigned wire_abits = 0;	//0 : native driver not configured
+
+#define ARRAY_SIZE(x)	(sizeof(x) / sizeof((x)[0]))
+
+/* the only registers eep_setwire() accepts as PxDR */
+static volatile u16 * const port_drs[] = {
+#if defined(SH7051)
+	&PA.DR.WORD, &PB.DR.WORD, &PC.DR.WORD, &PD.DR.WORD,
+	&PE.DR.WORD, &PF.DR.WORD, &PG.DR.WORD, &PH.DR.WORD,
+#else
+	&PA.DR.WORD, &PB.DR.WORD, &PC.DR.WORD, &PD.DR.WORD, &PE.DR.WORD, &PF.DR.WORD,
+	&PG.DR.WORD, &PH.DR.WORD, &PJ.DR.WORD, &PK.DR.WORD, &PL.DR.WORD,
+#endif
+};
+
+static bool is_port_dr(volatile u16 *dr) {
+	unsigned i;
+	for (i = 0; i < ARRAY_SIZE(port_drs); i++) {
+		if (dr == port_drs[i]) return 1;
+	}
+	return 0;
+}
+
+/* ~1us; 93C66 needs tSKH, tSKL >= 250ns and tPD <= 400ns (4.5-5.5V) */
+#define EEP_HALFCLK	20
+
+static void eep_delay(void) {
+	volatile unsigned cnt;
+	for (cnt = EEP_HALFCLK; cnt; cnt--) {}
+}
+
+/* PxDR bits are shared with other pins (possibly the WDT pin !), so do the
+ * read-modify-write with interrupts disabled */
+static void pin_set(unsigned pin, bool val) {
+	unsigned uim;
+	uim = imask_savedisable();
+	if (val) {
+		*wire_pins[pin].dr |= wire_pins[pin].mask;
+	} else {
+		*wire_pins[pin].dr &= ~wire_pins[pin].mask;
+	}
+	imask_restore(uim);
+}
+
+/** clock out one bit on DI */
+static void wire_txbit(bool val) {
+	pin_set(EEP_PIN_DI, val);
+	eep_delay();
+	pin_set(EEP_PIN_SK, 1);
+	eep_delay();
+	pin_set(EEP_PIN_SK, 0);
+}
+
+/** sequential read of n words from native driver */
+static void wire_readn(u16 addr, u16 *dest, unsigned n) {
+	int bit;
+
+	pin_set(EEP_PIN_SK, 0);
+	pin_set(EEP_PIN_CS, 1);
+	eep_delay();
+
+	wire_txbit(1);	//start bit
+	wire_txbit(1);	//opcode 10 : READ
+	wire_txbit(0);
+	for (bit = wire_abits - 1; bit >= 0; bit--) {
+		wire_txbit((addr >> bit) & 1);
+	}
+	pin_set(EEP_PIN_DI, 0);
+	//the dummy '0' is already on DO now
+
+	for (; n; n--, dest++) {
+		u16 val = 0;
+		for (bit = 0; bit < 16; bit++) {
+			pin_set(EEP_PIN_SK, 1);
+			eep_delay();
+			val <<= 1;
+			if (*wire_pins[EEP_PIN_DO].dr & wire_pins[EEP_PIN_DO].mask) {
+				val |= 1;
+			}
+			pin_set(EEP_PIN_SK, 0);
+			eep_delay();
+		}
+		*dest = val;
+	}
+
+	pin_set(EEP_PIN_CS, 0);
+	eep_delay();
+}
+
+
+bool eep_setwire(unsigned abits, const struct eep_pin *pins) {
+	unsigned i;
+
+	if (abits == 0) {
+		//back to builtin function
+		wire_abits = 0;
+		return 1;
+	}
+	if ((abits < EEP_ABITS_MIN) || (abits > EEP_ABITS_MAX)) return 0;
+
+	//check every pin before touching anything : a bad PxDR would get RMW'd by pin_set()
+	for (i = 0; i < EEP_NPINS; i++) {
+		if (!pins[i].mask || !is_port_dr(pins[i].dr)) return 0;
+	}
+	for (i = 0; i < EEP_NPINS; i++) {
+		wire_pins[i] = pins[i];
+	}
+	wire_abits = abits;
+	pin_set(EEP_PIN_CS, 0);
+	pin_set(EEP_PIN_SK, 0);
+	return 1;
+}
+#endif	//NPK_EEPWIRE
+
+
+void eep_readn(u16 addr, u16 *dest, unsigned n) {
+#ifdef NPK_EEPWIRE
+	if (wire_abits) {
+		wire_readn(addr, dest, n);
+		return;
+	}
+#endif
+
+	for (; n; n--, addr++, dest++) {
+		eep_read16(addr, dest);
+	}
+}
+
+
+void eep_read16(u16 addr, uint16_t *dest) {
+#ifdef NPK_EEPWIRE
+	if (wire_abits) {
+		wire_readn(addr, dest, 1);
+		return;
+	}
+#endif
 	if (builtin_eep_read16 == 0) return;
-	builtin_eep_read16(addr, dest);
+	builtin_eep_read16((uint8_t) addr, dest);
 	return;
 }
 
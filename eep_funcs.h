@@ -18,14 +18,38 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdbool.h>
 #include "stypes.h"
 
-//call ROM's  eeprom_read function. Does nothing if eep_setptr() hasn't been called yet
+/* Microwire pins for the native driver; DI / DO are from the EEPROM's point of view */
+enum eep_pinsel { EEP_PIN_CS, EEP_PIN_SK, EEP_PIN_DI, EEP_PIN_DO, EEP_NPINS };
 
-void eep_read16(uint8_t addr, uint16_t *dest);
+struct eep_pin {
+	volatile u16 *dr;	//PxDR
+	u16 mask;	//pin bit in PxDR
+};
+
+#define EEP_ABITS_MIN	6	//93C46 (x16)
+#define EEP_ABITS_MAX	16	//93C66 : 8; 93C86 : 10
+
+//read one word, with the native driver if configured; otherwise call ROM's eeprom_read function.
+//Does nothing if neither eep_setwire() nor eep_setptr() have been called yet
+
+void eep_read16(u16 addr, uint16_t *dest);
+
+//read n consecutive words. Uses a single sequential read with the native driver
+void eep_readn(u16 addr, u16 *dest, unsigned n);
 
 //set the address of the ROM's eeprom_read function
 void eep_setptr(void *newaddr);
 
+/** configure native Microwire driver (only built with NPK_EEPWIRE, see platf.h).
+ * @param abits : # of address bits (x16 organisation), or 0 to revert to the ROM's eeprom_read function
+ * @param pins : EEP_NPINS pin descriptors, in enum eep_pinsel order. Each dr must be a port data register
+ *
+ * @return 1 if ok; 0 (and nothing changed) if abits or any pin is invalid
+ */
+bool eep_setwire(unsigned abits, const struct eep_pin *pins);
+
 
 #endif
@@ -20,20 +20,53 @@
  */
 
 
+/* Many commands below are optional, only built with the matching NPK_* option of platf.h.
+ * Others get the usual NRC : ISO_NRC_SNS for a SID, ISO_NRC_SFNS_IF for a subcommand. */
+
+/* Aborting long operations (dumps, SID_CONF_CKSUM, SID_CONF_SEARCH, SID_DUMP_DIFF and scripts), with NPK_ABORT :
+ * the host sends any bytes (0x00 recommended) for at least SID_ABORT_INTV ms, then stops and waits.
+ * The kernel checks between frames / chunks, listening for SID_ABORT_WIN byte times every SID_ABORT_INTV ms while
+ * dumping. Once the line has been idle for 10ms, it replies with 7F <SID> NPK_NRC_ABORTED (see npk_errcodes.h);
+ * scripts instead end normally with status NPK_NRC_ABORTED. The command parser is back to its initial state.
+ */
+#define SID_ABORT_INTV	50
+#define SID_ABORT_WIN	2
+#define SID_ABORT_CHUNK	0x4000	//bytes processed between checks, when not transmitting
+
 #define SID_RECUID	0x1A	/* readECUID , in this case kernel ID */
 #define SID_RECUID_PRC	"\x5A"	/* positive response code, to be concatenated to version string */
 
 #define SID_RMBA 0x23	/* ReadMemByAddress. format : <SID_RMBA> <AH> <AM> <AL> <SIZ>  , siz <= 251. */
 				/* response : <SID + 0x40> <D0>....<Dn> <AH> <AM> <AL> */
+				/* scatter read (NPK_SCATTER) : <SID_RMBA> n * (<AH> <AM> <AL> <SIZ>) , n >= 2.
+				 * response : data of all tuples concatenated, split in frames of
+				 * <SID + 0x40> <D0>....<D253> (last frame shorter); no address echo. */
 
 #define SID_WMBA 0x3D	/* WriteMemByAddress (RAM only !) . format : <SID_WMBA> <AH> <AM> <AL> <SIZ> <DATA> , siz <= 250. */
 				/* response : <SID + 0x40> <AH> <AM> <AL> */
 
 #define SID_TP	0x3E	/* TesterPresent; not required but available. */
 
-#define SID_DUMP 0xBD	/* format : 0xBD <AS> <BH BL> <AH AL>  ; AS=0 for EEPROM, =1 for ROM */
+#define SID_DUMP 0xBD	/* format : 0xBD <AS> <BH BL> <AH AL>  ; AS=0 for EEPROM, =1 for ROM, =2 for packed ROM */
 	#define SID_DUMP_EEPROM	0
 	#define SID_DUMP_ROM 1
+	#define SID_DUMP_ROMZ 2	/* (NPK_ROMZ) same args as SID_DUMP_ROM; response frames are
+				 * <SID + 0x40> <ULH> <ULL> <CRCH> <CRCL> <packed data>
+				 * with UL = unpacked length of this frame, CRC = crc16 of the unpacked data.
+				 * See lzpack.h for the packed format */
+		#define SID_DUMPZ_MAXIN	4096	//max unpacked bytes per frame
+		#define SID_DUMPZ_PKMAX	250	//max packed bytes per frame
+	#define SID_DUMP_DIFF 3	/* (NPK_DUMPDIFF) incremental dump against host-cached crc16 of each granule :
+				 * <SID_DUMP> <SID_DUMP_DIFF> <GS> <A2> <A1> <A0> <CRC0H> <CRC0L> ... <CRCnH> <CRCnL>
+				 * GS bits 0-6 : granule size in 256B units; bit 7 : send changed granules packed (SID_DUMP_ROMZ frames)
+				 * Response : first <SID + 0x40> <N> <bitmap>, bit (0x80 >> (i % 8)) of byte (i / 8) set if granule i differs;
+				 * then the data of each changed granule, in order, as SID_DUMP_ROM (SID_DUMPD_PKTLEN bytes per frame)
+				 * or SID_DUMP_ROMZ frames (only with NPK_ROMZ). */
+		#define SID_DUMPD_GSMASK 0x7F
+		#define SID_DUMPD_PACKED 0x80
+		#define SID_DUMPD_GSUNIT 256
+		#define SID_DUMPD_MAXG	124	//max # of granules per request
+		#define SID_DUMPD_PKTLEN	128
 
 /* SID_FLASH and subcommands */
 #define SID_FLASH 0xBC	/* low-level reflash commands; only available after successful RequestDownload */
@@ -42,6 +75,22 @@
 	#define SIDFL_WB	0x02	//write n-byte block. format : <SID_FLASH> <SIDFL_WB> <A2> <A1> <A0> <D0>...<D(SIDFL_WB_DLEN -1)> <CRC>
 						// Address is <A2 A1 A0>;   CRC is calculated on address + data.
 	#define SIDFL_WB_DLEN	128	//bytes sent per niprog block
+	#define SIDFL_WR	0x03	//(NPK_FLWR) write pages from RAM. format : <SID_FLASH> <SIDFL_WR> <D2> <D1> <D0> <S2> <S1> <S0> <NH> <NL> <CRCH> <CRCL>
+						// Writes <NH NL> pages of SIDFL_WB_DLEN bytes at <D2 D1 D0>, from data previously staged in RAM
+						// at <S2 S1 S0> (with SID_WMBA). CRC is crc16 of the staged data. Single response once everything
+						// is written, so the whole transfer can be done first, with no flash delays between frames.
+	#define SIDFL_WRS	0x04	//(NPK_FLWR) sparse write from RAM. format : <SID_FLASH> <SIDFL_WRS> <D2> <D1> <D0> <S2> <S1> <S0> <NH> <NL> <CRCH> <CRCL> <bitmap>
+						// Like SIDFL_WR, but covers N pages of which only those with their bit set in <bitmap> were staged
+						// (contiguously, in order); bit (0x80 >> (i % 8)) of byte (i / 8) is for page i. The other pages are
+						// taken as all-0xFF, i.e. only checked to be blank. CRC is crc16 of the staged pages.
+		#define SIDFL_WRS_MAXPAGES	1024	//128kB; covers the largest erase block
+	#define SIDFL_CPY	0x05	//(NPK_FLCPY) copy flash to flash. format : <SID_FLASH> <SIDFL_CPY> <D2> <D1> <D0> <S2> <S1> <S0> <NH> <NL> <FLAGS>
+						// Copies <NH NL> pages of SIDFL_WB_DLEN bytes from <S2 S1 S0> to <D2 D1 D0>, staged through RAM.
+						// The ranges must not overlap. Without SIDFL_CPY_ERASE, the destination must already be blank;
+						// with it, every block touched by the destination is erased first, and must not contain the source.
+		#define SIDFL_CPY_ERASE	0x01
+	#define SIDFL_EBP	0x06	//erase block, and report the erase pulses. format : <SID_FLASH> <SIDFL_EBP> <BLOCK #>
+						// response : <SID + 0x40> <PH> <PL> , P = erase pulses used (0 on 180nm, or if already blank)
 
 /* SID_CONF and subcommands */
 #define SID_CONF 0xBE /* set & configure kernel */
@@ -54,10 +103,174 @@
 		#define ROMCRC_CHUNKSIZE 256
 	#define SID_CONF_R16 0x04		/* for debugging : do a 16bit access read at given adress in RAM (top byte 0xFF)
 									* <SID_CONF> <SID_CONF_R16> <A2> <A1> <A0> */
+	#define SID_CONF_EEPWIRE 0x05	/* (NPK_EEPWIRE) use native Microwire driver instead of eeprom_read() :
+					 * <SID_CONF> <SID_CONF_EEPWIRE> <ABITS> 4 * <PxDR_H> <PxDR_L> <BIT#> for CS, SK, DI, DO.
+					 * PxDR address is 0xFFFF<PxDR_H><PxDR_L>, must be a port data register; ABITS = 8 for 93C66, 10 for 93C86, 0 to disable */
+	#define SID_CONF_SEARCH 0x06	/* (NPK_SEARCH) masked pattern search :
+					 * <SID_CONF> <SID_CONF_SEARCH> <A2> <A1> <A0> <L2> <L1> <L0> <ALIGN> <MAXHITS> <PLEN> <P0>...<P(PLEN-1)> <M0>...<M(PLEN-1)>
+					 * matches where (mem[i] & M[i]) == (P[i] & M[i]), at addresses multiple of ALIGN (1, 2, 4...) in [A, A+L).
+					 * Response : <SID + 0x40> <NHITS> NHITS * <H2> <H1> <H0>; search again from last hit + ALIGN if NHITS == MAXHITS */
+		#define SID_CONF_SEARCH_MAXHITS	84	//max # of hits that fit in one response
+		#define SID_CONF_SEARCH_MAXPLEN	122
+	#define SID_CONF_CKSUM 0x07	/* (NPK_CKSUM) additive / xor checksum or CRC32 over one or more ranges :
+					 * <SID_CONF> <SID_CONF_CKSUM> <MODE> N * (<A2> <A1> <A0> <L2> <L1> <L0>) , N <= SID_CONF_CKSUM_MAXRGN
+					 * L must be a multiple of the word size, A aligned to the word size.
+					 * Response : <SID + 0x40> <S3> <S2> <S1> <S0> ; for sum16, use the low 16 bits */
+		#define SID_CKSUM_OPMASK	0x03
+		#define SID_CKSUM_SUM	0x00
+		#define SID_CKSUM_XOR	0x01
+		#define SID_CKSUM_CRC32	0x02	//CRC32 of all ranges, concatenated (see crc.c). Use with SID_CKSUM_W8
+		#define SID_CKSUM_WMASK	0x0C
+		#define SID_CKSUM_W8	0x00
+		#define SID_CKSUM_W16	0x04
+		#define SID_CKSUM_W32	0x08
+		#define SID_CKSUM_LE	0x10	//words are little-endian
+		#define SID_CONF_CKSUM_MAXRGN	42
+	#define SID_CONF_VFSTART 0x08	/* (NPK_VERIFY) start streaming verify of [A, A+L) against host data, A aligned on SID_VF_PAGESIZE, L <= SID_VF_MAXLEN.
+					 * <SID_CONF> <SID_CONF_VFSTART> <A2> <A1> <A0> <L2> <L1> <L0> */
+	#define SID_CONF_VFDATA 0x09	/* verify data, must be sent in order. NO RESPONSE !
+					 * <SID_CONF> <SID_CONF_VFDATA> <O2> <O1> <O0> <D0>...<Dn> , O = offset from A */
+	#define SID_CONF_VFEND	0x0A	/* end of verify, after L bytes were sent.
+					 * <SID_CONF> <SID_CONF_VFEND>
+					 * response : <SID + 0x40> <NPH> <NPL> <bitmap>; bit (0x80 >> (i % 8)) of byte (i / 8) set if page i differs.
+					 * NRC ISO_NRC_CNCORSE if data frames were missing or out of order */
+		#define SID_VF_PAGESIZE	128
+		#define SID_VF_MAXPAGES	1024	//128kB; covers the largest erase block
+		#define SID_VF_MAXLEN	(SID_VF_PAGESIZE * SID_VF_MAXPAGES)
+	#define SID_CONF_RUNSCRIPT 0x0B	/* (NPK_SCRIPT) run a script previously written to RAM with SID_WMBA :
+					 * <SID_CONF> <SID_CONF_RUNSCRIPT> <A2> <A1> <A0> <LH> <LL>
+					 * response : <SID + 0x40> <RV> <PCH> <PCL> ; RV = 0 if SCR_END was reached, else NRC of the failed op
+					 * (SID_CONF_CKS1_BADCKS for SCR_CRC / SCR_CMP mismatches). PC = offset of the last op executed. */
+		/* script opcodes; addresses are 24-bit, sign-extended like SID_RMBA.
+		 * An op that fails stops the script, unless the next op is SCR_BF. */
+		#define SCR_END	0x00	//<SCR_END> : stop, success
+		#define SCR_EB	0x01	//<SCR_EB> <BLOCK #> : erase block; needs SID_FLREQ first, like SID_FLASH
+		#define SCR_WB	0x02	//<SCR_WB> <D2> <D1> <D0> <S2> <S1> <S0> <LH> <LL> : program L bytes from RAM @S to flash @D
+		#define SCR_CRC	0x03	//<SCR_CRC> <A2> <A1> <A0> <L2> <L1> <L0> <CRCH> <CRCL> : check crc16 of [A, A+L)
+		#define SCR_CMP	0x04	//<SCR_CMP> <A2> <A1> <A0> <B2> <B1> <B0> <L2> <L1> <L0> : compare [A, A+L) with [B, B+L)
+		#define SCR_BF	0x05	//<SCR_BF> <OH> <OL> : if previous op failed, continue at script offset O
+		#define SCR_FAIL	0x06	//<SCR_FAIL> <CODE> : stop, RV = CODE
+		#define SCR_NUMOPS	7
+	#define SID_CONF_ARENA 0x0C	/* (NPK_ARENA) list free RAM regions, usable as staging buffers for SID_WMBA + SIDFL_WR, scripts etc.
+					 * <SID_CONF> <SID_CONF_ARENA>
+					 * response : <SID + 0x40> <N> N * (<A2> <A1> <A0> <L2> <L1> <L0>) ; addresses sign-extended like SID_RMBA */
+	#define SID_CONF_OVLOAD 0x0D	/* load + activate an overlay module (see ovl.h) previously written to RAM with SID_WMBA,
+					 * or just query the overlay region if no args :
+					 * <SID_CONF> <SID_CONF_OVLOAD> [<S2> <S1> <S0> <LH> <LL> <CRCH> <CRCL>] , CRC = crc16 of the module image
+					 * response : <SID + 0x40> <ID> <A2> <A1> <A0> <L2> <L1> <L0> ; ID of the active module (0 if none), overlay region.
+					 * Only available in kernels built with overlays. */
+	#define SID_CONF_BENCH 0x0E	/* (NPK_BENCH) run built-in microbenchmarks over SID_BENCH_LEN bytes of ROM @ 0 :
+					 * <SID_CONF> <SID_CONF_BENCH>
+					 * response : <SID + 0x40> SID_BENCH_NUM * <T3> <T2> <T1> <T0> , ATU0 ticks (1.6us) for each test,
+					 * in the order below. 0xFFFFFFFF if the test is not available.
+					 * This can take a second or so before responding. */
+		#define SID_BENCH_LEN	65536
+		#define SID_BENCH_CRC16	0	//crc16()
+		#define SID_BENCH_MEMCPY	1	//memcpy() to txbuf, 256B at a time
+		#define SID_BENCH_BLANK	2	//u32 blank scan
+		#define SID_BENCH_CKSU8	3	//cks_u8()
+		#define SID_BENCH_TX	4	//iso_sendpkt() with the transmitter disabled, SID_BENCH_LEN / 256 frames of 255 bytes
+		#define SID_BENCH_LZPACK	5	//lz_pack(), SID_DUMPZ_MAXIN at a time (needs NPK_ROMZ, and the overlay if built as one)
+		#define SID_BENCH_CRC32	6	//crc32() (needs NPK_CKSUM)
+		#define SID_BENCH_NUM	7
+	#define SID_CONF_AUTOBAUD 0x0F	/* (NPK_AUTOBAUD) measure the host's speed and switch to it :
+					 * <SID_CONF> <SID_CONF_AUTOBAUD> <PxDR_H> <PxDR_L> <BIT#> , port data register + bit that reads the RxD pin.
+					 * Positive response at the current speed; the host then sends SID_AUTOBAUD_NSYNC bytes of 0x55
+					 * at the new speed, within SID_AUTOBAUD_TMO ms. The kernel then switches (BRR) without responding;
+					 * like SID_CONF_SETSPEED, this requires a new StartComm request at the new speed. If the measurement
+					 * fails, the speed doesn't change. Only useful from ~10kbps (interrupts are masked while timing each byte,
+					 * which must stay short for the WDT) up to ~125kbps (timing resolution is 1.6us). */
+		#define SID_AUTOBAUD_NSYNC	16
+		#define SID_AUTOBAUD_TMO	1000
+	#define SID_CONF_LINKSTAT 0x10	/* (NPK_LINKSTAT) read link error counters : <SID_CONF> <SID_CONF_LINKSTAT> [<CLR>]
+					 * resp : <SID_CONF + 0x40> SID_LINKSTAT_NUM * (<CH> <CL>) in the order below. Counters saturate at 0xFFFF.
+					 * If <CLR> is present and non-zero, counters are cleared after being read. */
+		#define SID_LINKSTAT_ORER	0	//SCI overrun
+		#define SID_LINKSTAT_FER	1	//SCI framing error
+		#define SID_LINKSTAT_PER	2	//SCI parity error
+		#define SID_LINKSTAT_BADHDR	3	//unsupported iso14230 header
+		#define SID_LINKSTAT_BADCKS	4	//bad iso14230 checksum
+		#define SID_LINKSTAT_RESYNC	5	//sci_rxidle() had to discard data or clear errors
+		#define SID_LINKSTAT_FLCKS	6	//SID_FLASH frame or staged data rejected for bad checksum / CRC
+		#define SID_LINKSTAT_NUM	7
+	#define SID_CONF_CAPS 0x11	/* (NPK_CAPS) capability descriptor : <SID_CONF> <SID_CONF_CAPS>
+					 * resp : <SID_CONF + 0x40> followed by TLV fields <T> <L> <V0>...<V(L-1)>, in any order;
+					 * unknown types must be skipped. Multi-byte values are big-endian. */
+		#define SID_CAP_VER	0x01	//NPK_VER string, same as the SID_RECUID response
+		#define SID_CAP_PLATF	0x02	//target name string (PLATF)
+		#define SID_CAP_FBLOCKS	0x03	//erase block table, N * <A2 A1 A0>; the last entry is the end of flash
+		#define SID_CAP_MAXROM	0x04	//<A2 A1 A0> : last valid flash address (FL_MAXROM)
+		#define SID_CAP_RAM	0x05	//<RAM_MIN (4)> <RAM_MAX (4)>
+		#define SID_CAP_ARENA	0x06	//free RAM regions, same format as the SID_CONF_ARENA response (only with NPK_ARENA)
+		#define SID_CAP_SIDS	0x07	//N * (<SID> <NS> <SUB0>...<SUB(NS-1)>) : supported SIDs + subcommands
+		#define SID_CAP_MAXPL	0x08	//<RX> <TX> : max data bytes per frame (including SID), each way
+		#define SID_CAP_SCI	0x09	/* <B3 B2 B1 B0> <CKS> <BRR> <FLAGS> : speed = B / (4^CKS * (BRR + 1)) bps,
+						 * with B the speed at CKS = BRR = 0 and CKS, BRR the current settings.
+						 * Any BRR is usable with SID_CONF_SETSPEED; FLAGS bit 0 : SID_CONF_AUTOBAUD available */
+			#define SID_CAP_SCI_BASE	625000UL
+			#define SID_CAP_SCI_AUTOBAUD	0x01
+	#define SID_CONF_STREAM 0x13	/* (NPK_STREAM) raw streaming transfer : <SID_CONF> <SID_CONF_STREAM> <DIR> <A2> <A1> <A0> <L2> <L1> <L0> <IH> <IL>
+					 * After the positive response <SID_CONF + 0x40> <SID_CONF_STREAM>, the L bytes at A are sent (DIR = 0)
+					 * or received (DIR = 1, RAM only) as a plain byte stream, without iso14230 framing.
+					 * Every I bytes (I = 0 : only once, at the end) and after the last byte, the sender adds the crc16 of that chunk,
+					 * <CRCH> <CRCL>. No acks : on a bad CRC, the receiving kernel ignores the rest of the stream.
+					 * Then the kernel sends a normal status frame <SID_CONF + 0x40> <SID_CONF_STREAM> <STATUS> <D2> <D1> <D0>,
+					 * D = # of bytes transferred with a valid CRC, and returns to iso14230 parsing.
+					 * Sending can be aborted at checkpoints (see SID_ABORT_INTV). When receiving, the kernel gives up if
+					 * the line is idle for SID_STREAM_TMO ms. */
+		#define SID_STREAM_DOWN	0	//kernel -> host
+		#define SID_STREAM_UP	1	//host -> kernel
+		#define SID_STREAM_TMO	100
+		/* status codes */
+		#define SID_STREAM_OK	0
+		#define SID_STREAM_BADCRC	1
+		#define SID_STREAM_TIMEOUT	2
+		#define SID_STREAM_RXERR	3	//ORER, FER or PER
+		#define SID_STREAM_ABORTED	4
+	#define SID_CONF_TRACE 0x12	/* event trace control, only if built with NPK_TRACE (see platf.h) :
+					 * <SID_CONF> <SID_CONF_TRACE> <MODE> ; MODE 0 : info only, 1 : clear and (re)start, 2 : freeze
+					 * resp : <SID_CONF + 0x40> <A3 A2 A1 A0> <NH NL> <IH IL> <FLAGS>
+					 * A : address of the ring (read with SID_RMBA), N : # of entries, I : next entry to be written.
+					 * FLAGS bit 0 : ring has wrapped (oldest entry is I), bit 1 : frozen.
+					 * Freeze before reading, so the RMBA requests aren't recorded over the ring.
+					 * Each entry is <T3 T2 T1 T0> <EVT> <A8> <A16H A16L>, T = ATU0 timestamp (1.6us ticks) */
+		#define SID_TRACE_INFO	0
+		#define SID_TRACE_CLEAR	1
+		#define SID_TRACE_FREEZE	2
+		#define SID_TRACE_WRAPPED	0x01
+		#define SID_TRACE_FROZEN	0x02
+		/* event types; A8, A16 : */
+		#define SID_TRACE_RXSTART	0x01	//FMT byte, -
+		#define SID_TRACE_RXEND	0x02	//0 if ok / 1 if rejected, datalen
+		#define SID_TRACE_DISPATCH	0x03	//SID, subcommand (or 0)
+		#define SID_TRACE_TXSTART	0x04	//SID, len
+		#define SID_TRACE_TXEND	0x05	//-, - (TEND)
+		#define SID_TRACE_EBSTART	0x06	//block #, -
+		#define SID_TRACE_EBEND	0x07	//NRC (0 if ok), erase pulses
+		#define SID_TRACE_WBSTART	0x08	//dest >> 16, dest & 0xFFFF
+		#define SID_TRACE_WBEND	0x09	//NRC (0 if ok), len / SIDFL_WB_DLEN
+		#define SID_TRACE_RESYNC	0x0A	//-, ms
 
 #define SID_FLREQ 0x34	/* RequestDownload */
 #define SID_STARTCOMM 0x81 /* startCommunication */
 
+#define SID_ATP	0x83	/* (NPK_ATP) AccessTimingParameters. format : <SID_ATP> <TPI> [<P2min> <P2max> <P3min> <P3max> <P4min>]
+			 * response : <SID + 0x40> <TPI> [<P2min> <P2max> <P3min> <P3max> <P4min>] for the "read" TPIs.
+			 * Units : 0.5ms for P2min, P3min, P4min; 25ms for P2max; 250ms for P3max.
+			 * The kernel can reply, and take the next request, immediately : limits are 0 for P2min / P3min.
+			 * It honours P2min (delay before the first response frame to a request) and applies P4min as
+			 * inter-byte gap on transmit, for adapters that can't keep up at high speeds.
+			 * P2max / P3max are only stored : the kernel has no session timeout, and erasing can take seconds.
+			 * SID_ATP_SET is refused (CNCORSE) if a value is outside the limits, P4min > SID_ATP_P4MAX,
+			 * P2min > P2max or P3min > P3max; the current values are then kept.
+			 * New values are applied after the positive response. */
+	#define SID_ATP_LIMITS	0x00	//read limits
+	#define SID_ATP_DEFAULTS	0x01	//set to defaults (no delays)
+	#define SID_ATP_CURRENT	0x02	//read current values
+	#define SID_ATP_SET	0x03	//set values
+	#define SID_ATP_NPARAM	5
+	#define SID_ATP_P4MAX	40	//max allowed P4min : 20ms
+
 #define SID_RESET 0x11	/* restart ECU */
 
 #endif
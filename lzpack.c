@@ -0,0 +1,282 @@
+/* Lightweight RLE + LZ compressor, see lzpack.h for the stream format.
+ *
+ * Main goal is to pack ROM dumps (lots of 0xFF padding and repetitive tables)
+ * with very little code, no RAM window (the source is memory-mapped anyway)
+ * and a tiny hash table.
+ *
+ * This file has no target-specific dependencies; it can also be compiled on the host
+ * to measure compression ratio + throughput against ROM images, see LZPACK_HOST below.
+ */
+
+/* (c) copyright a33b 2020
+ * GPLv3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <string.h>	//memcpy, memset
+
+#include "stypes.h"
+#include "lzpack.h"
+
+/* when built as an overlay (see ovl.h), everything goes in the .ovl_lzpack section */
+#ifdef OVL_LZPACK
+	#include "ovl.h"
+	#define LZ_TEXT	OVL_SECTION(lzpack, "text")
+	#define LZ_DATA	OVL_SECTION(lzpack, "data")
+#else
+	#define LZ_TEXT
+	#define LZ_DATA
+#endif
+
+/* hash of the next 3 bytes => most recent position. 64 entries is plenty for a 256B window */
+#define LZ_HASHBITS	6
+#define LZ_HASHSIZE	(1 << LZ_HASHBITS)
+
+static const u8 *lz_htab[LZ_HASHSIZE] LZ_DATA;
+
+LZ_TEXT static unsigned lz_hash(const u8 *p) {
+	u32 v = (p[0] << 16) | (p[1] << 8) | p[2];
+	v *= 0x9E3779B1UL;
+	return (u32) v >> (32 - LZ_HASHBITS);
+}
+
+
+LZ_TEXT u32 lz_pack(const u8 *src, u32 srclen, u8 *dst, u32 dstmax, u32 *dlen) {
+	const u8 *cur = src;
+	const u8 *end = src + srclen;
+	u8 *out = dst;
+	u8 *oend = dst + dstmax;
+	u8 *lit = NULL;	//control byte of the current literal run, if any
+	unsigned i;
+
+	/* back-refs must stay inside this block */
+	for (i = 0; i < LZ_HASHSIZE; i++) {
+		lz_htab[i] = NULL;
+	}
+
+	while (cur < end) {
+		u32 avail = end - cur;
+		u32 len;
+		u8 val = *cur;
+
+		/* 1) byte run; by far the most common case in ROM padding */
+		len = 1;
+		while ((len < avail) && (len < LZ_RUNMAX) && (cur[len] == val)) {
+			len++;
+		}
+		if (len >= LZ_RUNMIN) {
+			if ((oend - out) < 2) break;
+			*out++ = 0x80 | (len - LZ_RUNMIN);
+			*out++ = val;
+			cur += len;
+			lit = NULL;
+			continue;
+		}
+
+		/* 2) back-reference to the last position with the same hash */
+		if (avail >= LZ_RUNMIN) {
+			unsigned h = lz_hash(cur);
+			const u8 *cand = lz_htab[h];
+
+			lz_htab[h] = cur;
+			if (cand && ((u32) (cur - cand) <= LZ_DISTMAX)) {
+				u32 max = avail;
+				if (max > LZ_RUNMAX) max = LZ_RUNMAX;
+
+				for (len = 0; (len < max) && (cand[len] == cur[len]); len++) {}
+
+				if (len >= LZ_RUNMIN) {
+					if ((oend - out) < 2) break;
+					*out++ = 0xC0 | (len - LZ_RUNMIN);
+					*out++ = (u8) ((cur - cand) - 1);
+					cur += len;
+					lit = NULL;
+					continue;
+				}
+			}
+		}
+
+		/* 3) literal; start a new run if required */
+		if (lit) {
+			if (out == oend) break;
+		} else {
+			if ((oend - out) < 2) break;
+			lit = out++;
+			*lit = (u8) -1;
+		}
+		*lit += 1;
+		*out++ = val;
+		cur++;
+		if (*lit == (LZ_LITMAX - 1)) {
+			lit = NULL;
+		}
+	}
+
+	*dlen = out - dst;
+	return cur - src;
+}
+
+
+LZ_TEXT u32 lz_unpack(const u8 *src, u32 srclen, u8 *dst, u32 dstmax) {
+	const u8 *end = src + srclen;
+	u32 o = 0;
+
+	while (src < end) {
+		u8 c = *src++;
+		u32 len;
+		u32 dist;
+
+		if (c < 0x80) {
+			len = c + 1;
+			if (((u32) (end - src) < len) || ((dstmax - o) < len)) return 0;
+			memcpy(&dst[o], src, len);
+			src += len;
+			o += len;
+			continue;
+		}
+
+		len = (c & 0x3F) + LZ_RUNMIN;
+		if ((src == end) || ((dstmax - o) < len)) return 0;
+
+		if (c < 0xC0) {
+			memset(&dst[o], *src++, len);
+			o += len;
+			continue;
+		}
+
+		dist = *src++ + 1;
+		if (dist > o) return 0;
+		for (; len; len--, o++) {
+			//may overlap, must be done bytewise
+			dst[o] = dst[o - dist];
+		}
+	}
+	return o;
+}
+
+
+#ifdef OVL_LZPACK
+const struct ovl_hdr ovl_lzpack_hdr OVL_SECTION(lzpack, "hdr") = {
+	.magic = OVL_MAGIC,
+	.kernel_end = endpayload,
+	.id = OVL_ID_LZPACK,
+	.calls.lzpack = {
+		.pack = lz_pack,
+		.unpack = lz_unpack,
+	},
+};
+#endif
+
+
+#ifdef LZPACK_HOST
+/* Host build, to measure ratio and throughput against a collection of ROM dumps :
+ *	gcc -O2 -DLZPACK_HOST -I . -o lzpack lzpack.c
+ *	./lzpack rom1.bin rom2.bin ...
+ *
+ * Frames are split exactly like the kernel's SID_DUMP_ROMZ loop, and line time is
+ * estimated from the iso14230 framing overhead of both dump modes.
+ * Each packed frame is unpacked and compared.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "iso_cmds.h"
+
+#define LINE_BPS	62500UL
+
+static int lz_test(const char *fname) {
+	FILE *f;
+	u8 *rom, *chk;
+	long siz;
+	u32 pos, frames = 0;
+	u32 raw_wire = 0, z_wire = 0, packed = 0;
+	clock_t t_pack = 0;
+
+	f = fopen(fname, "rb");
+	if (!f) {
+		perror(fname);
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	siz = ftell(f);
+	rewind(f);
+	rom = malloc(siz);
+	chk = malloc(SID_DUMPZ_MAXIN);
+	if (!rom || !chk || (fread(rom, 1, siz, f) != (size_t) siz)) {
+		printf("%s: read error\n", fname);
+		fclose(f);
+		free(rom);
+		free(chk);
+		return -1;
+	}
+	fclose(f);
+
+	/* SID_DUMP_ROM : <len> <SID> <32 data bytes> <cks> */
+	raw_wire = ((siz + 31) / 32) * 3 + siz;
+
+	for (pos = 0; pos < (u32) siz; ) {
+		u8 pbuf[SID_DUMPZ_PKMAX];
+		u32 plen, ulen, in;
+		clock_t t0;
+
+		in = siz - pos;
+		if (in > SID_DUMPZ_MAXIN) in = SID_DUMPZ_MAXIN;
+
+		t0 = clock();
+		ulen = lz_pack(&rom[pos], in, pbuf, sizeof(pbuf), &plen);
+		t_pack += clock() - t0;
+
+		if ((ulen == 0) ||
+			(lz_unpack(pbuf, plen, chk, SID_DUMPZ_MAXIN) != ulen) ||
+			memcmp(chk, &rom[pos], ulen)) {
+			printf("%s: mismatch @ 0x%06lX !\n", fname, (unsigned long) pos);
+			free(rom);
+			free(chk);
+			return -1;
+		}
+
+		/* <FMT> [<len>] <SID> <ULH> <ULL> <CRCH> <CRCL> <packed> <cks> */
+		z_wire += plen + 5 + ((plen + 5) > 0x3F ? 2 : 1) + 1;
+		packed += plen;
+		pos += ulen;
+		frames += 1;
+	}
+
+	printf("%s: %ld => %lu B (%.2f:1) in %lu frames; line time %.1fs => %.1fs (x%.2f); pack %.1f MB/s (host)\n",
+		fname, siz, (unsigned long) packed, (double) siz / packed, (unsigned long) frames,
+		raw_wire * 10.0 / LINE_BPS, z_wire * 10.0 / LINE_BPS, (double) raw_wire / z_wire,
+		t_pack ? (siz / 1e6) / ((double) t_pack / CLOCKS_PER_SEC) : 0.0);
+
+	free(rom);
+	free(chk);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	int i;
+	int rv = 0;
+
+	if (argc < 2) {
+		printf("usage: %s <rom.bin> [<rom2.bin> ...]\n", argv[0]);
+		return 1;
+	}
+	for (i = 1; i < argc; i++) {
+		if (lz_test(argv[i])) rv = 1;
+	}
+	return rv;
+}
+#endif	//LZPACK_HOST
@@ -0,0 +1,53 @@
+#ifndef _LZPACK_H
+#define _LZPACK_H
+/* Lightweight RLE + LZ compressor for ROM dumps */
+
+/* (c) copyright a33b 2020
+ * GPLv3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stypes.h"
+
+/* Packed stream format. Each token starts with a control byte <C> :
+ *
+ * C = 0x00..0x7F : literal run; (C + 1) raw bytes follow.
+ * C = 0x80..0xBF : byte run; ((C & 0x3F) + 3) copies of the next byte.
+ * C = 0xC0..0xFF : back-reference; copy ((C & 0x3F) + 3) bytes starting
+ *			(<D> + 1) bytes behind the current output position. <D> follows C.
+ *
+ * Back-references never reach before the start of the block passed to lz_pack(),
+ * so every packed block can be unpacked on its own.
+ */
+#define LZ_LITMAX	128
+#define LZ_RUNMIN	3
+#define LZ_RUNMAX	(0x3F + LZ_RUNMIN)
+#define LZ_DISTMAX	256
+
+
+/** Pack as much of src[] as will fit in dstmax bytes.
+ *
+ * @param dlen : set to the number of bytes written to dst
+ * @return number of src bytes consumed (always > 0 if srclen and dstmax >= 2)
+ */
+u32 lz_pack(const u8 *src, u32 srclen, u8 *dst, u32 dstmax, u32 *dlen);
+
+/** Unpack a block produced by lz_pack().
+ *
+ * @return number of bytes written to dst, or 0 if the packed data is invalid or doesn't fit.
+ */
+u32 lz_unpack(const u8 *src, u32 srclen, u8 *dst, u32 dstmax);
+
+#endif
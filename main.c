@@ -22,6 +22,7 @@
 #include "functions.h"	//for set_imask etc
 
 #include "platf.h"
+#include "arena.h"
 #include "cmd_parser.h"
    
 
@@ -75,6 +76,9 @@ void main(void) {
 	set_imask(0x0F);	// disable interrupts (mask = b'1111)
 
 	init_platf();
+#ifdef NPK_ARENA
+	arena_init();
+#endif
 
 	/* parse preload struct to get wdt info */
 	wdt_dr = (u16 *) ((rjp->wdt_portH << 16) | (rjp->wdt_portL));
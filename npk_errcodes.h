@@ -22,6 +22,9 @@
 /* SID_CONF error codes */
 #define SID_CONF_CKS1_BADCKS	0x77	//NRC when crc is bad
 
+/* NRC for long operations stopped by the host, see SID_ABORT_INTV */
+#define NPK_NRC_ABORTED	0x7A
+
 
 /**** Common flash error codes for all platforms. */
 
@@ -38,6 +41,7 @@
  * and double as the iso14230 NRC*/
 #define PF_ERROR 0x80		//generic flashing error : FWE, etc
 #define PF_SILICON 0x81	//Not running on correct silicon (180 / 350nm)
+#define PF_CLOCK 0x82	//delay loop calibration against ATU0 failed (350nm, 7051)
 
 #define PFEB_BADBLOCK (0x84 | 0x00)	//bad block #
 #define PFEB_VERIFAIL (0x84 | 0x01)	//erase verify failed
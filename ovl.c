@@ -0,0 +1,70 @@
+/* Loadable overlay modules, see ovl.h */
+
+/* (c) copyright a33b 2020
+ * GPLv3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <string.h>	//memmove
+
+#include "stypes.h"
+#include "platf.h"
+#include "crc.h"
+#include "npk_errcodes.h"
+#include "ovl.h"
+
+static unsigned ovl_active;	//OVL_ID_NONE until a module passes ovl_load()
+
+
+u32 ovl_load(u32 src, u32 len, u16 crc) {
+	const struct ovl_hdr *hdr = (const struct ovl_hdr *) ovl_start;
+
+	if (	(len < sizeof(struct ovl_hdr)) ||
+		(len > (u32) (ovl_end - ovl_start)) ||
+		(src < RAM_MIN) ||
+		(src > RAM_MAX) ||
+		(len > (RAM_MAX - src + 1))) {
+		return ISO_NRC_CNDTSA;
+	}
+
+	ovl_active = OVL_ID_NONE;
+	memmove(ovl_start, (const void *) src, len);
+
+	if (crc16(ovl_start, len) != crc) {
+		return SID_CONF_CKS1_BADCKS;
+	}
+	if (	(hdr->magic != OVL_MAGIC) ||
+		(hdr->kernel_end != endpayload) ||
+		(hdr->id == OVL_ID_NONE)) {
+		return ISO_NRC_CNCORSE;
+	}
+
+	ovl_active = hdr->id;
+	return 0;
+}
+
+
+const struct ovl_hdr *ovl_get(unsigned id) {
+	if ((id == OVL_ID_NONE) || (id != ovl_active)) {
+		return NULL;
+	}
+	return (const struct ovl_hdr *) ovl_start;
+}
+
+
+unsigned ovl_getactive(void) {
+	return ovl_active;
+}
@@ -0,0 +1,88 @@
+#ifndef _OVL_H
+#define _OVL_H
+/* Loadable overlay modules.
+ *
+ * Optional features can be built as overlays ("make OVL_LZPACK=1" etc) : their code and data go in
+ * a separate linker section (.ovl_<module>), linked to run in the OVLY region of the linker script,
+ * and extracted as a separate .ovl file. The kernel image is smaller by that much, and the host only
+ * uploads the module (SID_WMBA + SID_CONF_OVLOAD) if it needs it.
+ * Only one module can be active at a time.
+ */
+
+/* (c) copyright a33b 2020
+ * GPLv3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stypes.h"
+
+#if defined(OVL_LZPACK)
+	#define NPK_OVERLAYS
+#endif
+
+#if defined(NPK_OVERLAYS) && defined(SH7051)
+	#error No overlay region on 7051 (see lkr_7051.ld)
+#endif
+
+/* put an object in the given module's section, e.g. OVL_SECTION(lzpack, "text") */
+#define OVL_SECTION(mod, sec) __attribute__((section(".ovl_" #mod "." sec)))
+
+#define OVL_MAGIC	0x4F564C31	//"OVL1"
+
+enum ovl_id {
+	OVL_ID_NONE = 0,
+	OVL_ID_LZPACK = 1,
+};
+
+/* call tables, one per module */
+struct ovl_lzpack_calls {
+	u32 (*pack)(const u8 *src, u32 srclen, u8 *dst, u32 dstmax, u32 *dlen);
+	u32 (*unpack)(const u8 *src, u32 srclen, u8 *dst, u32 dstmax);
+};
+
+/* every module starts with this header, at the start of OVLY. */
+struct ovl_hdr {
+	u32 magic;
+	const u8 *kernel_end;	//endpayload of the kernel it was linked with; modules from another build are rejected
+	u16 id;	//enum ovl_id
+	u16 rsvd;
+	union {
+		struct ovl_lzpack_calls lzpack;
+	} calls;
+};
+
+/* set at linkage */
+extern u8 ovl_start[];
+extern u8 ovl_end[];
+extern u8 endpayload[];
+
+/** Copy a module (previously written to RAM) into the overlay region, check it and activate it.
+ *
+ * @param src : RAM address of the module image; may be ovl_start itself
+ * @param crc : crc16 of the whole image
+ * @return 0 if ok, NRC otherwise. No module is active after a failure
+ */
+u32 ovl_load(u32 src, u32 len, u16 crc);
+
+/** Get the header + call table of module <id>
+ *
+ * @return NULL if that module isn't the active one
+ */
+const struct ovl_hdr *ovl_get(unsigned id);
+
+/** @return id of the active module, OVL_ID_NONE if none */
+unsigned ovl_getactive(void);
+
+#endif
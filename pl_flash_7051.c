@@ -47,14 +47,13 @@ This was hacked together by a33b
 #error Wrong target specified !
 #endif
 
-#define FL_MAXROM	(256*1024UL - 1UL)
 
 
 /********** Timing defs
 */
 
-//20MHz clock. Some critical timing depends on this being true,
-//WDT stuff in particular isn't macro-fied
+//Nominal 20MHz clock. Flash delays are checked against ATU0 at init (waitn_calibrate),
+//but WDT stuff isn't macro-fied
 #define CPUFREQ	(20)
 
 #define WDT_RSTCSR_SETTING 0x5A4F	//reset if TCNT overflows
@@ -62,33 +61,33 @@ This was hacked together by a33b
 #define WDT_TCSR_WSTART (0xA578 | 0x05)	//write value to start with 1:1024 div (13.1 ms @ 20MHz), for write runaway
 #define WDT_TCSR_STOP 0xA558	//write value to stop WDT count
 
-//KEN TODO recheck calculation
-#define WAITN_TCYCLE 4		/* KEN clock cycles per loop, see asm */
-#define WAITN_CALCN(usec) (((usec) * CPUFREQ / WAITN_TCYCLE) + 1)
+/* All delays below are in microseconds, see waitus(). */
+#define WAITUS_ATU_MIN	100	//delays this long or longer are timed with ATU0
+#define WAITN_CALIB	5000	//loops for the waitn() calibration, see waitn_calibrate()
 
 
 /** Common timing constants */
-#define TSSWE	WAITN_CALCN(10)
-#define TCSWE	WAITN_CALCN(100)  //Not in Hitachi datasheet, but shouldn't hurt
+#define TSSWE	10
+#define TCSWE	100  //Not in Hitachi datasheet, but shouldn't hurt
 
 /** Erase timing constants */
-#define TSESU	WAITN_CALCN(200)
-#define TSE	WAITN_CALCN(5000UL)
-#define TCE	WAITN_CALCN(10)
-#define TCESU	WAITN_CALCN(10)
-#define TSEV	WAITN_CALCN(10)	/******** Renesas has 20 for this !?? */
-#define TSEVR	WAITN_CALCN(2)
-#define TCEV	WAITN_CALCN(5)
+#define TSESU	200
+#define TSE	5000UL
+#define TCE	10
+#define TCESU	10
+#define TSEV	10	/******** Renesas has 20 for this !?? */
+#define TSEVR	2
+#define TCEV	5
 
 
 /** Write timing constants */
-#define TSPSU	WAITN_CALCN(300) //Datasheet has 50, F-ZTAT has 300
-#define TSP500	WAITN_CALCN(500)
-#define TCP		WAITN_CALCN(10)
-#define TCPSU	WAITN_CALCN(10)
-#define TSPV	WAITN_CALCN(10) //Datasheet has 4, F-ZTAT has 10
-#define TSPVR	WAITN_CALCN(5) //Datasheet has 2, F-ZTAT has 5
-#define TCPV	WAITN_CALCN(5) //Datasheet has 4, F-ZTAT has 5
+#define TSPSU	300 //Datasheet has 50, F-ZTAT has 300
+#define TSP500	500
+#define TCP		10
+#define TCPSU	10
+#define TSPV	10 //Datasheet has 4, F-ZTAT has 10
+#define TSPVR	5 //Datasheet has 2, F-ZTAT has 5
+#define TCPV	5 //Datasheet has 4, F-ZTAT has 5
 
 
 /** FLASH constants */
@@ -133,11 +132,11 @@ static bool reflash_enabled = 0;	//global flag to protect flash, see platf_flash
 
 static volatile u8 *pFLMCR;	//will point to FLMCR1 or FLMCR2 as required
 
+static unsigned eb_pulses;	//erase pulses used by the last platf_flash_eb()
 
-/** spin for <loops> .
- * Constants should be calculated at compile-time.
- */
-#define WAITN_TCYCLE	4	//clock cycles per loop  KEN to verify
+
+/** spin for <loops> . */
+#define WAITN_TCYCLE	4	//nominal clock cycles per loop
 
 static void waitn(unsigned loops) {
 	u32 tmp;
@@ -145,6 +144,53 @@ static void waitn(unsigned loops) {
 	asm volatile ("bf 0b");
 }
 
+/* waitn() loops per 8us (= 5 ATU0 ticks). Nominal value until waitn_calibrate() runs. */
+static u32 waitn_8us = 8 * CPUFREQ / WAITN_TCYCLE;
+
+/** Measure the waitn() loop rate against ATU0.
+ *
+ * This catches a wrong WAITN_TCYCLE (RAM wait states etc); it can't catch a non-standard crystal
+ * since ATU0 runs from the same clock. A crystal far enough off to matter would also break the SCI link.
+ * @return 0 if the result is implausible (less than half or more than twice nominal)
+ */
+static bool waitn_calibrate(void) {
+	u32 t0, ticks, k;
+	unsigned uim;
+
+	uim = imask_savedisable();
+	t0 = get_mclk_ts();
+	waitn(WAITN_CALIB);
+	ticks = get_mclk_ts() - t0;
+	imask_restore(uim);
+
+	/* real duration is > (ticks - 1) ; round towards more loops, i.e. longer delays */
+	if (ticks < 2) return 0;
+	ticks -= 1;
+	k = ((WAITN_CALIB * 5) + ticks - 1) / ticks;
+
+	if (	(k < (4 * CPUFREQ / WAITN_TCYCLE)) ||
+		(k > (16 * CPUFREQ / WAITN_TCYCLE))) {
+		return 0;
+	}
+	waitn_8us = k;
+	return 1;
+}
+
+/** spin for at least <us> microseconds.
+ *
+ * Long delays poll ATU0; rounded up, +1 tick for the unknown phase of the first tick.
+ * Short ones use calibrated waitn() loops, since ATU0 only has 1.6us resolution.
+ */
+static void waitus(u32 us) {
+	if (us >= WAITUS_ATU_MIN) {
+		u32 t0 = get_mclk_ts();
+		u32 ticks = (((us * 10) + 15) / 16) + 1;
+		while ((u32) (get_mclk_ts() - t0) < ticks) {}
+		return;
+	}
+	waitn((((us * waitn_8us) + 7) / 8) + 1);
+}
+
 
 
 /** Check FWE and FLER bits
@@ -159,43 +205,47 @@ static bool fwecheck(void) {
 /** Set SWE bit and wait */
 static void sweset(void) {
 	FLASH.FLMCR1.BIT.SWE = 1;
-	waitn(TSSWE);
+	waitus(TSSWE);
 	return;
 }
 
 /** Clear SWE bit and wait */
 static void sweclear(void) {
 	FLASH.FLMCR1.BIT.SWE = 0;
-	waitn(TCSWE);
+	waitus(TCSWE);
 }
 
 
 /*********** Erase ***********/
 
-/** Erase verification
+/** Erase verification, from *vpos to the end of the block.
+ * As in the DS flowchart, verify mode is entered once for the whole pass.
+ * On failure *vpos is left at the first non-erased word; everything before it
+ * is already erased, so the next pass resumes from there.
  * Assumes pFLMCR is set, of course
  * ret 1 if ok
  */
-static bool ferasevf(unsigned blockno) {
+static bool ferasevf(unsigned blockno, volatile u32 **vpos) {
 	bool rv = 1;
 	volatile u32 *cur, *end;
 
-	cur = (volatile u32 *) fblocks[blockno];
+	cur = *vpos;
 	end = (volatile u32 *) fblocks[blockno + 1];
 
+	*pFLMCR |= FLMCR_EV;
+	waitus(TSEV);
 	for (; cur < end; cur++) {
-		*pFLMCR |= FLMCR_EV;
-		waitn(TSEV);
 		*cur = 0xFFFFFFFF;
-		waitn(TSEVR);
+		waitus(TSEVR);
 		if (*cur != 0xFFFFFFFF) {
 			rv = 0;
 			break;
 		}
 	}
 	*pFLMCR &= ~FLMCR_EV;
-	waitn(TCEV);
+	waitus(TCEV);
 
+	*vpos = cur;
 	return rv;
 }
 
@@ -221,13 +271,13 @@ static void ferase(unsigned blockno) {
 	WDT.WRITE.TCSR = WDT_TCSR_ESTART;
 
 	*pFLMCR |= FLMCR_ESU;
-	waitn(TSESU);
+	waitus(TSESU);
 	*pFLMCR |= FLMCR_E;	//start Erase pulse
-	waitn(TSE);
+	waitus(TSE);
 	*pFLMCR &= ~FLMCR_E;	//stop pulse
-	waitn(TCE);
+	waitus(TCE);
 	*pFLMCR &= ~FLMCR_ESU;
-	waitn(TCESU);
+	waitus(TCESU);
 
 	WDT.WRITE.TCSR = WDT_TCSR_STOP;
 
@@ -239,8 +289,9 @@ static void ferase(unsigned blockno) {
 
 
 uint32_t platf_flash_eb(unsigned blockno) {
-	unsigned count;
+	volatile u32 *vpos;
 
+	eb_pulses = 0;
 	if (blockno >= BLK_MAX) return PFEB_BADBLOCK;
 	if (!reflash_enabled) return 0;
 
@@ -258,28 +309,23 @@ uint32_t platf_flash_eb(unsigned blockno) {
 	WDT.WRITE.TCSR = WDT_TCSR_STOP;
 	WDT.WRITE.RSTCSR = WDT_RSTCSR_SETTING;
 
-	/* XXX is this pre-erase verify really necessary ?? DS doesn't say so;
-	 * FDT example has this, and Nissan kernel doesn't
+	/* Verify before the first pulse too (DS doesn't require it; FDT example has it,
+	 * Nissan kernel doesn't). A blank block then needs no pulses at all, and for a
+	 * programmed one the pass stops at the first non-erased word so it costs next to nothing.
 	 */
-#if 0
-	if (ferasevf(blockno)) {
-		//already blank
-		sweclear();
-		return 0;
-	}
-#endif
-
-
-	for (count = 0; count < MAX_ET; count++) {
-		ferase(blockno);
-		if (ferasevf(blockno)) {
+	vpos = (volatile u32 *) fblocks[blockno];
+	while (!ferasevf(blockno, &vpos)) {
+		if (eb_pulses >= MAX_ET) {
+			/* haven't managed to get a succesful ferasevf() : badexit */
 			sweclear();
-			return 0;
+			return PFEB_VERIFAIL;
 		}
+		ferase(blockno);
+		eb_pulses++;
 	}
-	/* haven't managed to get a succesful ferasevf() : badexit */
+
 	sweclear();
-	return PFEB_VERIFAIL;
+	return 0;
 
 }
 
@@ -306,13 +352,13 @@ static void writepulse(volatile u8 *dest, u8 *src, unsigned tsp) {
 	WDT.WRITE.TCSR = WDT_TCSR_WSTART;
 
 	*pFLMCR |= FLMCR_PSU;
-	waitn(TSPSU);		//F-ZTAT has 300 here
+	waitus(TSPSU);		//F-ZTAT has 300 here
 	*pFLMCR |= FLMCR_P;
-	waitn(tsp);
+	waitus(tsp);
 	*pFLMCR &= ~FLMCR_P;
-	waitn(TCP);
+	waitus(TCP);
 	*pFLMCR &= ~FLMCR_PSU;
-	waitn(TCPSU);
+	waitus(TCPSU);
 	WDT.WRITE.TCSR = WDT_TCSR_STOP;
 
 //	set_imask(prev_imask);
@@ -321,7 +367,8 @@ static void writepulse(volatile u8 *dest, u8 *src, unsigned tsp) {
 
 
 /** ret 0 if ok, NRC if error
- * assumes params are ok, and that block was already erased
+ * assumes params are ok, that block was already erased,
+ * and that SWE is on (see platf_flash_wb)
  */
 static u32 flash_write32(u32 dest, u32 src_unaligned) {
 	u8 src[32] __attribute ((aligned (4)));	// aligned copy of desired data
@@ -329,7 +376,6 @@ static u32 flash_write32(u32 dest, u32 src_unaligned) {
 
 	unsigned n;
 	bool m;
-	u32 rv;
 
 	if (dest < FLMCR2_BEGIN) {
 		pFLMCR = &FLASH.FLMCR1.BYTE;
@@ -337,17 +383,9 @@ static u32 flash_write32(u32 dest, u32 src_unaligned) {
 		pFLMCR = &FLASH.FLMCR2.BYTE;
 	}
 
-	if (!fwecheck()) {
-		return PF_ERROR;
-	}
-
 	memcpy(src, (void *) src_unaligned, 32);
 	memcpy(reprog, (void *) src, 32);
 
-	sweset();
-	WDT.WRITE.TCSR = WDT_TCSR_STOP;
-	WDT.WRITE.RSTCSR = WDT_RSTCSR_SETTING;
-
 	for (n=1; n < MAX_WT; n++) {
 		unsigned cur;
 
@@ -358,7 +396,7 @@ static u32 flash_write32(u32 dest, u32 src_unaligned) {
 
 		//2) Program verify
 		*pFLMCR |= FLMCR_PV;
-		waitn(TSPV);	//F-ZTAT has 10 here
+		waitus(TSPV);	//F-ZTAT has 10 here
 
 		for (cur = 0; cur < 32; cur += 4) {
 			u32 verifdata;
@@ -367,7 +405,7 @@ static u32 flash_write32(u32 dest, u32 src_unaligned) {
 
 			//dummy write 0xFFFFFFFF
 			*(volatile u32 *) (dest + cur) = (u32) -1;
-			waitn(TSPVR);	//F-ZTAT has 5 here
+			waitus(TSPVR);	//F-ZTAT has 5 here
 
 			verifdata = *(volatile u32 *) (dest + cur);
 			srcdata = *(u32 *) (src + cur);
@@ -389,8 +427,9 @@ static u32 flash_write32(u32 dest, u32 src_unaligned) {
 */
 			if (srcdata & ~verifdata) {
 				//wanted '1' bits, but somehow got '0's : serious error
-				rv = PFWB_VERIFAIL;
-				goto badexit;
+				*pFLMCR &= ~FLMCR_PV;
+				waitus(TCPV);
+				return PFWB_VERIFAIL;
 			}
 			//compute reprogramming data. This fits with my reading of both the DS and the FDT code,
 			//but Nissan proceeds differently
@@ -398,7 +437,7 @@ static u32 flash_write32(u32 dest, u32 src_unaligned) {
 		}	//for (program verif)
 
 		*pFLMCR &= ~FLMCR_PV;
-		waitn(TCPV);	//F-ZTAT has 5 here
+		waitus(TCPV);	//F-ZTAT has 5 here
 
 /*	this check is not in 7050
 		if (n <= 6) {
@@ -408,42 +447,76 @@ static u32 flash_write32(u32 dest, u32 src_unaligned) {
 */
 		if (!m) {
 			//success
-			sweclear();
 			return 0;
 		}
 
 	}	//for (n < 400)
 
 	//failed, max # of retries
-	rv = PFWB_MAXRET;
-badexit:
-	sweclear();
-	return rv;
+	return PFWB_MAXRET;
 }
 
 
+/** ret 1 if all <len> bytes at <addr> are 0xFF. addr may be unaligned */
+static bool page_isblank(u32 addr, u32 len) {
+	const u8 *p = (const u8 *) addr;
+
+	for (; len; len--) {
+		if (*p++ != 0xFF) return 0;
+	}
+	return 1;
+}
+
+/* SWE (only in FLMCR1 on this chip) stays set across all the 32-byte units of a call,
+ * instead of paying TSSWE + TCSWE for each one. All-0xFF units are skipped entirely.
+ */
 uint32_t platf_flash_wb(uint32_t dest, uint32_t src, uint32_t len) {
+	uint32_t rv = 0;
+	bool swe = 0;	//SWE is only set once there's something to program
 
-	if (dest > FL_MAXROM) return PFWB_OOB;
+	if ((dest > FL_MAXROM) || (len > (FL_MAXROM - dest + 1))) return PFWB_OOB;
 	if (dest & 0x1F) return PFWB_MISALIGNED;	//dest not aligned on 32B boundary
 	if (len & 0x1F) return PFWB_LEN;	//must be multiple of 32B too
 
 	if (!reflash_enabled) return 0;	//pretend success
 
+	if (!fwecheck()) {
+		return PF_ERROR;
+	}
+
 	while (len) {
-		uint32_t rv = 0;
+		if (page_isblank(src, 32)) {
+			/* nothing to program. Bits can only go from 1 to 0, so dest must already be blank */
+			if (!page_isblank(dest, 32)) {
+				rv = PFWB_VERIFAIL;
+				break;
+			}
+			dest += 32;
+			src += 32;
+			len -= 32;
+			continue;
+		}
+
+		if (!swe) {
+			sweset();
+			swe = 1;
+			WDT.WRITE.TCSR = WDT_TCSR_STOP;
+			WDT.WRITE.RSTCSR = WDT_RSTCSR_SETTING;
+		}
 
 		rv = flash_write32(dest, src);
 
 		if (rv) {
-			return rv;
+			break;
 		}
 
 		dest += 32;
 		src += 32;
 		len -= 32;
 	}
-	return 0;
+
+	if (swe) sweclear();
+	return rv;
 }
 
 
@@ -459,6 +532,11 @@ bool platf_flash_init(u8 *err) {
 		return 0;
 	}
 
+	if (!waitn_calibrate()) {
+		*err = PF_CLOCK;
+		return 0;
+	}
+
 	/* suxxess ! */
 	return 1;
 
@@ -469,3 +547,8 @@ void platf_flash_unprotect(void) {
 	reflash_enabled = 1;
 }
 
+
+unsigned platf_flash_eb_pulses(void) {
+	return eb_pulses;
+}
+
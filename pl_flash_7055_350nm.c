@@ -70,8 +70,8 @@ sh-elf-size with write + erase C implems: 4292	1024	548 => 5864, delta = 912B
  *
  * This is for SH7055 (0.35um) and assumes this RAM map (see .ld file)
  *
- * - stack @ 0xFFFF BFFC (growing downwards)
- * - kernel @ 0xFFFF 8100, this leaves ~16k for both kernel + stack
+ * - stack @ 0xFFFF DFFC (growing downwards)
+ * - kernel @ 0xFFFF 8100
  */
 
 
@@ -79,7 +79,6 @@ sh-elf-size with write + erase C implems: 4292	1024	548 => 5864, delta = 912B
 #error Wrong target specified !
 #endif
 
-#define FL_MAXROM	(512*1024UL - 1UL)
 
 #define FLASH_180_FKEY ((volatile uint8_t *) 0xFFFFE804)	//exists only on 180nm ICs. Used for process size detection
 
@@ -87,8 +86,8 @@ sh-elf-size with write + erase C implems: 4292	1024	548 => 5864, delta = 912B
 /********** Timing defs
 */
 
-//Assume 40MHz clock. Some critical timing depends on this being true,
-//WDT stuff in particular isn't macro-fied
+//Nominal 40MHz clock. Flash delays are checked against ATU0 at init (waitn_calibrate),
+//but WDT stuff isn't macro-fied
 #define CPUFREQ	(40)
 
 #define WDT_RSTCSR_SETTING 0x5A5F;	//power-on reset if TCNT overflows
@@ -96,35 +95,35 @@ sh-elf-size with write + erase C implems: 4292	1024	548 => 5864, delta = 912B
 #define WDT_TCSR_WSTART (0xA578 | 0x05)	//write value to start with 1:1024 div (6.6 ms @ 40MHz), for write runaway
 #define WDT_TCSR_STOP 0xA558	//write value to stop WDT count
 
-//TODO recheck calculation
-#define WAITN_TCYCLE 4		/* clock cycles per loop, see asm */
-#define WAITN_CALCN(usec) (((usec) * CPUFREQ / WAITN_TCYCLE) + 1)
+/* All delays below are in microseconds, see waitus(). */
+#define WAITUS_ATU_MIN	100	//delays this long or longer are timed with ATU0
+#define WAITN_CALIB	5000	//loops for the waitn() calibration, see waitn_calibrate()
 
 
 /** Common timing constants */
-#define TSSWE	WAITN_CALCN(1)
-#define TCSWE	WAITN_CALCN(100)
+#define TSSWE	1
+#define TCSWE	100
 
 /** Erase timing constants */
-#define TSESU	WAITN_CALCN(100)
-#define TSE	WAITN_CALCN(10000UL)
-#define TCE	WAITN_CALCN(10)
-#define TCESU	WAITN_CALCN(10)
-#define TSEV	WAITN_CALCN(6)	/******** Renesas has 20 for this !?? */
-#define TSEVR	WAITN_CALCN(2)
-#define TCEV	WAITN_CALCN(4)
+#define TSESU	100
+#define TSE	10000UL
+#define TCE	10
+#define TCESU	10
+#define TSEV	6	/******** Renesas has 20 for this !?? */
+#define TSEVR	2
+#define TCEV	4
 
 
 /** Write timing constants */
-#define TSPSU	WAITN_CALCN(50)
-#define TSP10	WAITN_CALCN(10)
-#define TSP30	WAITN_CALCN(30)
-#define TSP200	WAITN_CALCN(200)
-#define TCP	WAITN_CALCN(5)
-#define TCPSU	WAITN_CALCN(5)
-#define TSPV	WAITN_CALCN(4)
-#define TSPVR	WAITN_CALCN(2)
-#define TCPV	WAITN_CALCN(2)
+#define TSPSU	50
+#define TSP10	10
+#define TSP30	30
+#define TSP200	200
+#define TCP	5
+#define TCPSU	5
+#define TSPV	4
+#define TSPVR	2
+#define TCPV	2
 
 
 /** FLASH constants */
@@ -174,11 +173,11 @@ static bool reflash_enabled = 0;	//global flag to protect flash, see platf_flash
 
 static volatile u8 *pFLMCR;	//will point to FLMCR1 or FLMCR2 as required
 
+static unsigned eb_pulses;	//erase pulses used by the last platf_flash_eb()
 
-/** spin for <loops> .
- * Constants should be calculated at compile-time.
- */
-#define WAITN_TCYCLE	4	//clock cycles per loop
+
+/** spin for <loops> . */
+#define WAITN_TCYCLE	4	//nominal clock cycles per loop
 
 static void waitn(unsigned loops) {
 	u32 tmp;
@@ -186,6 +185,53 @@ static void waitn(unsigned loops) {
 	asm volatile ("bf 0b");
 }
 
+/* waitn() loops per 8us (= 5 ATU0 ticks). Nominal value until waitn_calibrate() runs. */
+static u32 waitn_8us = 8 * CPUFREQ / WAITN_TCYCLE;
+
+/** Measure the waitn() loop rate against ATU0.
+ *
+ * This catches a wrong WAITN_TCYCLE (RAM wait states etc); it can't catch a non-standard crystal
+ * since ATU0 runs from the same clock. A crystal far enough off to matter would also break the SCI link.
+ * @return 0 if the result is implausible (less than half or more than twice nominal)
+ */
+static bool waitn_calibrate(void) {
+	u32 t0, ticks, k;
+	unsigned uim;
+
+	uim = imask_savedisable();
+	t0 = get_mclk_ts();
+	waitn(WAITN_CALIB);
+	ticks = get_mclk_ts() - t0;
+	imask_restore(uim);
+
+	/* real duration is > (ticks - 1) ; round towards more loops, i.e. longer delays */
+	if (ticks < 2) return 0;
+	ticks -= 1;
+	k = ((WAITN_CALIB * 5) + ticks - 1) / ticks;
+
+	if (	(k < (4 * CPUFREQ / WAITN_TCYCLE)) ||
+		(k > (16 * CPUFREQ / WAITN_TCYCLE))) {
+		return 0;
+	}
+	waitn_8us = k;
+	return 1;
+}
+
+/** spin for at least <us> microseconds.
+ *
+ * Long delays poll ATU0; rounded up, +1 tick for the unknown phase of the first tick.
+ * Short ones use calibrated waitn() loops, since ATU0 only has 1.6us resolution.
+ */
+static void waitus(u32 us) {
+	if (us >= WAITUS_ATU_MIN) {
+		u32 t0 = get_mclk_ts();
+		u32 ticks = (((us * 10) + 15) / 16) + 1;
+		while ((u32) (get_mclk_ts() - t0) < ticks) {}
+		return;
+	}
+	waitn((((us * waitn_8us) + 7) / 8) + 1);
+}
+
 
 
 /** Check FWE and FLER bits
@@ -200,43 +246,47 @@ static bool fwecheck(void) {
 /** Set SWE bit and wait */
 static void sweset(void) {
 	*pFLMCR |= FLMCR_SWE;
-	waitn(TSSWE);
+	waitus(TSSWE);
 	return;
 }
 
 /** Clear SWE bit and wait */
 static void sweclear(void) {
 	*pFLMCR &= ~FLMCR_SWE;
-	waitn(TCSWE);
+	waitus(TCSWE);
 }
 
 
 /*********** Erase ***********/
 
-/** Erase verification
+/** Erase verification, from *vpos to the end of the block.
+ * As in the DS flowchart, verify mode is entered once for the whole pass.
+ * On failure *vpos is left at the first non-erased word; everything before it
+ * is already erased, so the next pass resumes from there.
  * Assumes pFLMCR is set, of course
  * ret 1 if ok
  */
-static bool ferasevf(unsigned blockno) {
+static bool ferasevf(unsigned blockno, volatile u32 **vpos) {
 	bool rv = 1;
 	volatile u32 *cur, *end;
 
-	cur = (volatile u32 *) fblocks[blockno];
+	cur = *vpos;
 	end = (volatile u32 *) fblocks[blockno + 1];
 
+	*pFLMCR |= FLMCR_EV;
+	waitus(TSEV);
 	for (; cur < end; cur++) {
-		*pFLMCR |= FLMCR_EV;
-		waitn(TSEV);
 		*cur = 0xFFFFFFFF;
-		waitn(TSEVR);
+		waitus(TSEVR);
 		if (*cur != 0xFFFFFFFF) {
 			rv = 0;
 			break;
 		}
 	}
 	*pFLMCR &= ~FLMCR_EV;
-	waitn(TCEV);
+	waitus(TCEV);
 
+	*vpos = cur;
 	return rv;
 }
 
@@ -262,13 +312,13 @@ static void ferase(unsigned blockno) {
 	WDT.WRITE.TCSR = WDT_TCSR_ESTART;
 
 	*pFLMCR |= FLMCR_ESU;
-	waitn(TSESU);
+	waitus(TSESU);
 	*pFLMCR |= FLMCR_E;	//start Erase pulse
-	waitn(TSE);
+	waitus(TSE);
 	*pFLMCR &= ~FLMCR_E;	//stop pulse
-	waitn(TCE);
+	waitus(TCE);
 	*pFLMCR &= ~FLMCR_ESU;
-	waitn(TCESU);
+	waitus(TCESU);
 
 	WDT.WRITE.TCSR = WDT_TCSR_STOP;
 
@@ -280,8 +330,9 @@ static void ferase(unsigned blockno) {
 
 
 uint32_t platf_flash_eb(unsigned blockno) {
-	unsigned count;
+	volatile u32 *vpos;
 
+	eb_pulses = 0;
 	if (blockno >= BLK_MAX) return PFEB_BADBLOCK;
 	if (!reflash_enabled) return 0;
 
@@ -299,28 +350,23 @@ uint32_t platf_flash_eb(unsigned blockno) {
 	WDT.WRITE.TCSR = WDT_TCSR_STOP;
 	WDT.WRITE.RSTCSR = WDT_RSTCSR_SETTING;
 
-	/* XXX is this pre-erase verify really necessary ?? DS doesn't say so;
-	 * FDT example has this, and Nissan kernel doesn't
+	/* Verify before the first pulse too (DS doesn't require it; FDT example has it,
+	 * Nissan kernel doesn't). A blank block then needs no pulses at all, and for a
+	 * programmed one the pass stops at the first non-erased word so it costs next to nothing.
 	 */
-#if 0
-	if (ferasevf(blockno)) {
-		//already blank
-		sweclear();
-		return 0;
-	}
-#endif
-
-
-	for (count = 0; count < MAX_ET; count++) {
-		ferase(blockno);
-		if (ferasevf(blockno)) {
+	vpos = (volatile u32 *) fblocks[blockno];
+	while (!ferasevf(blockno, &vpos)) {
+		if (eb_pulses >= MAX_ET) {
+			/* haven't managed to get a succesful ferasevf() : badexit */
 			sweclear();
-			return 0;
+			return PFEB_VERIFAIL;
 		}
+		ferase(blockno);
+		eb_pulses++;
 	}
-	/* haven't managed to get a succesful ferasevf() : badexit */
+
 	sweclear();
-	return PFEB_VERIFAIL;
+	return 0;
 
 }
 
@@ -347,13 +393,13 @@ static void writepulse(volatile u8 *dest, u8 *src, unsigned tsp) {
 	WDT.WRITE.TCSR = WDT_TCSR_WSTART;
 
 	*pFLMCR |= FLMCR_PSU;
-	waitn(TSPSU);
+	waitus(TSPSU);
 	*pFLMCR |= FLMCR_P;
-	waitn(tsp);
+	waitus(tsp);
 	*pFLMCR &= ~FLMCR_P;
-	waitn(TCP);
+	waitus(TCP);
 	*pFLMCR &= ~FLMCR_PSU;
-	waitn(TCPSU);
+	waitus(TCPSU);
 	WDT.WRITE.TCSR = WDT_TCSR_STOP;
 
 //	set_imask(prev_imask);
@@ -362,7 +408,8 @@ static void writepulse(volatile u8 *dest, u8 *src, unsigned tsp) {
 
 
 /** ret 0 if ok, NRC if error
- * assumes params are ok, and that block was already erased
+ * assumes params are ok, that block was already erased,
+ * and that pFLMCR is set and SWE is on (see platf_flash_wb)
  */
 static u32 flash_write128(u32 dest, u32 src_unaligned) {
 	u8 src[128] __attribute ((aligned (4)));	// aligned copy of desired data
@@ -371,25 +418,10 @@ static u32 flash_write128(u32 dest, u32 src_unaligned) {
 
 	unsigned n;
 	bool m;
-	u32 rv;
-
-	if (dest < FLMCR2_BEGIN) {
-		pFLMCR = &FLASH.FLMCR1.BYTE;
-	} else {
-		pFLMCR = &FLASH.FLMCR2.BYTE;
-	}
-
-	if (!fwecheck()) {
-		return PF_ERROR;
-	}
 
 	memcpy(src, (void *) src_unaligned, 128);
 	memcpy(reprog, (void *) src, 128);
 
-	sweset();
-	WDT.WRITE.TCSR = WDT_TCSR_STOP;
-	WDT.WRITE.RSTCSR = WDT_RSTCSR_SETTING;
-
 	for (n=1; n < MAX_WT; n++) {
 		unsigned cur;
 
@@ -405,7 +437,7 @@ static u32 flash_write128(u32 dest, u32 src_unaligned) {
 
 		//2) Program verify
 		*pFLMCR |= FLMCR_PV;
-		waitn(TSPV);
+		waitus(TSPV);
 
 		for (cur = 0; cur < 128; cur += 4) {
 			u32 verifdata;
@@ -414,7 +446,7 @@ static u32 flash_write128(u32 dest, u32 src_unaligned) {
 
 			//dummy write 0xFFFFFFFF
 			*(volatile u32 *) (dest + cur) = (u32) -1;
-			waitn(TSPVR);
+			waitus(TSPVR);
 
 			verifdata = *(volatile u32 *) (dest + cur);
 			srcdata = *(u32 *) (src + cur);
@@ -435,8 +467,9 @@ static u32 flash_write128(u32 dest, u32 src_unaligned) {
 
 			if (srcdata & ~verifdata) {
 				//wanted '1' bits, but somehow got '0's : serious error
-				rv = PFWB_VERIFAIL;
-				goto badexit;
+				*pFLMCR &= ~FLMCR_PV;
+				waitus(TCPV);
+				return PFWB_VERIFAIL;
 			}
 			//compute reprogramming data. This fits with my reading of both the DS and the FDT code,
 			//but Nissan proceeds differently
@@ -444,7 +477,7 @@ static u32 flash_write128(u32 dest, u32 src_unaligned) {
 		}	//for (program verif)
 
 		*pFLMCR &= ~FLMCR_PV;
-		waitn(TCPV);
+		waitus(TCPV);
 
 		if (n <= 6) {
 			// write additional reprog data
@@ -453,42 +486,85 @@ static u32 flash_write128(u32 dest, u32 src_unaligned) {
 
 		if (!m) {
 			//success
-			sweclear();
 			return 0;
 		}
 
 	}	//for (n < 1000)
 
 	//failed, max # of retries
-	rv = PFWB_MAXRET;
-badexit:
-	sweclear();
-	return rv;
+	return PFWB_MAXRET;
 }
 
 
+/** ret 1 if all <len> bytes at <addr> are 0xFF. addr may be unaligned */
+static bool page_isblank(u32 addr, u32 len) {
+	const u8 *p = (const u8 *) addr;
+
+	for (; len; len--) {
+		if (*p++ != 0xFF) return 0;
+	}
+	return 1;
+}
+
+/* SWE stays set across consecutive pages; it only needs to be cycled when
+ * crossing into the area controlled by the other FLMCR. This saves TSSWE + TCSWE per page.
+ * All-0xFF pages are skipped entirely.
+ */
 uint32_t platf_flash_wb(uint32_t dest, uint32_t src, uint32_t len) {
+	volatile u8 *swe_flmcr = NULL;	//FLMCR that currently has SWE set
+	uint32_t rv = 0;
 
-	if (dest > FL_MAXROM) return PFWB_OOB;
+	if ((dest > FL_MAXROM) || (len > (FL_MAXROM - dest + 1))) return PFWB_OOB;
 	if (dest & 0x7F) return PFWB_MISALIGNED;	//dest not aligned on 128B boundary
 	if (len & 0x7F) return PFWB_LEN;	//must be multiple of 128B too
 
 	if (!reflash_enabled) return 0;	//pretend success
 
 	while (len) {
-		uint32_t rv = 0;
+		volatile u8 *want;
 
-		rv = flash_write128(dest, src);
+		if (page_isblank(src, 128)) {
+			/* nothing to program. Bits can only go from 1 to 0, so dest must already be blank */
+			if (!page_isblank(dest, 128)) {
+				rv = PFWB_VERIFAIL;
+				break;
+			}
+			dest += 128;
+			src += 128;
+			len -= 128;
+			continue;
+		}
 
+		want = (dest < FLMCR2_BEGIN) ? &FLASH.FLMCR1.BYTE : &FLASH.FLMCR2.BYTE;
+		if (want != swe_flmcr) {
+			if (swe_flmcr) {
+				sweclear();
+			}
+			pFLMCR = want;
+			swe_flmcr = NULL;
+			if (!fwecheck()) {
+				rv = PF_ERROR;
+				break;
+			}
+			sweset();
+			swe_flmcr = want;
+			WDT.WRITE.TCSR = WDT_TCSR_STOP;
+			WDT.WRITE.RSTCSR = WDT_RSTCSR_SETTING;
+		}
+
+		rv = flash_write128(dest, src);
 		if (rv) {
-			return rv;
+			break;
 		}
 
 		dest += 128;
 		src += 128;
 		len -= 128;
 	}
-	return 0;
+
+	//SWE was never set if every page was skipped (or len == 0)
+	if (swe_flmcr) sweclear();
+	return rv;
 }
 
 
@@ -511,6 +587,11 @@ bool platf_flash_init(u8 *err) {
 		return 0;
 	}
 
+	if (!waitn_calibrate()) {
+		*err = PF_CLOCK;
+		return 0;
+	}
+
 	/* suxxess ! */
 	return 1;
 
@@ -521,3 +602,8 @@ void platf_flash_unprotect(void) {
 	reflash_enabled = 1;
 }
 
+
+unsigned platf_flash_eb_pulses(void) {
+	return eb_pulses;
+}
+
@@ -32,10 +32,10 @@
  *
  * These are for SH7058 and SH7055 (0.18um), and assume this RAM map :
  *
- * - stack @ 0xFFFF BFFC (growing downwards)
- * - kernel @ 0xFFFF 8100, this leaves ~16k for both kernel + stack
+ * - stack at the end of RAM (growing downwards)
+ * - kernel @ 0xFFFF 8100
  * and according to mcu type:
- * - mcu's built-in erase and write programs copied @ 0xFFFF1000 or 0xFFFF7000
+ * - mcu's built-in erase and write programs copied @ FL_ERASE_BASE, FL_WRITE_BASE (see platf.h)
  */
 
 
@@ -47,11 +47,6 @@
 #define FTDAR_WRITE 0x03
 
 #if defined(SH7058)
-#define FL_ERASE_BASE	0xFFFF1000
-#define FL_WRITE_BASE	0xFFFF1800
-
-#define FL_MAXROM	(1024*1024UL - 1UL)
-
 const u32 fblocks[] = {
 	0x00000000,
 	0x00001000,
@@ -74,11 +69,6 @@ const u32 fblocks[] = {
 
 #elif defined(SH7055_18)
 
-#define FL_ERASE_BASE	0xFFFF7000
-#define FL_WRITE_BASE	0xFFFF7800
-
-#define FL_MAXROM	(512*1024UL - 1UL)
-
 const u32 fblocks[] = {
 	0x00000000,
 	0x00001000,
@@ -243,6 +233,11 @@ void platf_flash_unprotect(void) {
 }
 
 
+unsigned platf_flash_eb_pulses(void) {
+	return 0;	//handled by the microcode
+}
+
+
 uint32_t platf_flash_eb(unsigned blockno) {
 	uint32_t FPFR;
 
@@ -280,14 +275,33 @@ static uint32_t flash_write128(uint32_t dest, uint32_t src) {
 }
 
 
+/** ret 1 if all <len> bytes at <addr> are 0xFF. addr may be unaligned */
+static bool page_isblank(u32 addr, u32 len) {
+	const u8 *p = (const u8 *) addr;
+
+	for (; len; len--) {
+		if (*p++ != 0xFF) return 0;
+	}
+	return 1;
+}
+
+/* All-0xFF pages are skipped entirely */
 uint32_t platf_flash_wb(uint32_t dest, uint32_t src, uint32_t len) {
+	uint32_t rv = 0;
 
-	if (dest > FL_MAXROM) return PFWB_OOB;
+	if ((dest > FL_MAXROM) || (len > (FL_MAXROM - dest + 1))) return PFWB_OOB;
 	if (dest & 0x7F) return PFWB_MISALIGNED;	//dest not aligned on 128B boundary
 	if (len & 0x7F) return PFWB_LEN;	//must be multiple of 128B too
 
 	while (len) {
-		uint32_t rv = 0;
+		if (reflash_enabled && page_isblank(src, 128)) {
+			/* nothing to program. Bits can only go from 1 to 0, so dest must already be blank */
+			if (!page_isblank(dest, 128)) return PFWB_VERIFAIL;
+			dest += 128;
+			src += 128;
+			len -= 128;
+			continue;
+		}
 
 		if (reflash_enabled) {
 			rv = flash_write128(dest, src);
@@ -21,6 +21,46 @@
 /* Uncomment to taint WDT pulse for debug use */
 //#define DIAG_TAINTWDT
 
+/* Uncomment to cache the crc16 of every 256B of flash (SID_CONF_CKS1, SID_DUMP_DIFF), filled while cmd_loop() is idle.
+ * It takes (ROM size / 128) + (ROM size / 2048) bytes from the RAM arena at startup, e.g. 8.5kB on 7058 */
+//#define NPK_CRCMAP
+
+/* Uncomment to record timestamped comms / flash events in a RAM ring, see SID_CONF_TRACE. 8 bytes per entry */
+//#define NPK_TRACE
+#define NPK_TRACE_NENT	128
+
+/* RAM kept below the initial stack pointer, never handed out by the arena */
+#define STACK_RESERVE	2048
+
+/* Optional commands. The kernel must fit in RJFIX (see the linker scripts : 8kB on 7055 / 7058, 6kB on 7051),
+ * so only the base command set is built by default; uncomment what the host needs.
+ * SID_CONF_CAPS, if built, reports what's available. */
+//#define NPK_ROMZ	//SID_DUMP_ROMZ packed dumps (lzpack.c). Implied by "make OVL_LZPACK=1"
+//#define NPK_DUMPDIFF	//SID_DUMP_DIFF incremental dumps
+//#define NPK_SCATTER	//SID_RMBA scatter reads
+//#define NPK_SEARCH	//SID_CONF_SEARCH
+//#define NPK_CKSUM	//SID_CONF_CKSUM. CRC32 mode takes 1kB of RAM for its table (see crc.c)
+//#define NPK_VERIFY	//SID_CONF_VFSTART / VFDATA / VFEND streaming verify
+//#define NPK_SCRIPT	//SID_CONF_RUNSCRIPT
+//#define NPK_FLWR	//SIDFL_WR, SIDFL_WRS : program from RAM
+//#define NPK_FLCPY	//SIDFL_CPY
+//#define NPK_ARENA	//SID_CONF_ARENA free RAM regions (arena.c)
+//#define NPK_EEPWIRE	//SID_CONF_EEPWIRE native Microwire driver
+//#define NPK_ABORT	//host can abort long operations, see SID_ABORT_INTV
+//#define NPK_LINKSTAT	//SID_CONF_LINKSTAT
+//#define NPK_ATP	//SID_ATP AccessTimingParameters
+//#define NPK_AUTOBAUD	//SID_CONF_AUTOBAUD
+//#define NPK_STREAM	//SID_CONF_STREAM
+//#define NPK_BENCH	//SID_CONF_BENCH
+//#define NPK_CAPS	//SID_CONF_CAPS
+
+#if defined(OVL_LZPACK) && !defined(NPK_ROMZ)
+	#define NPK_ROMZ
+#endif
+#if defined(NPK_CRCMAP) && !defined(NPK_ARENA)
+	#define NPK_ARENA	//the cache is allocated from the arena
+#endif
+
 
 
 #include <stdbool.h>
@@ -29,6 +69,9 @@
 /*
  * RAMJUMP_PRELOAD_META : where the pre-ramjump metadata is stored (wdt pin, s36k2, etc)
  * RAM_MIN, RAM_MAX : whole RAM area
+ * FL_MAXROM : last valid flash address
+ * FL_ERASE_BASE, FL_WRITE_BASE : where the erase / write microcode is downloaded (0.18um only, see FTDAR).
+ *	each takes FL_UCODE_SIZE bytes of RAM
  * " #include "reg_defines/????" : i/o peripheral registers
  */
 
@@ -38,6 +81,9 @@
 	#define RAM_MIN	0xFFFF0000
 	#define RAM_MAX 	0xFFFFBFFF
 	#define RAMJUMP_PRELOAD_META 0xffff8000
+	#define FL_MAXROM	(1024*1024UL - 1UL)
+	#define FL_ERASE_BASE	0xFFFF1000
+	#define FL_WRITE_BASE	0xFFFF1800
 	#define NPK_SCI SCI1
 
 #elif defined(SH7055_18)
@@ -45,6 +91,9 @@
 	#define RAM_MIN	0xFFFF6000
 	#define RAM_MAX	0xFFFFDFFF
 	#define RAMJUMP_PRELOAD_META 0xffff8000
+	#define FL_MAXROM	(512*1024UL - 1UL)
+	#define FL_ERASE_BASE	0xFFFF7000
+	#define FL_WRITE_BASE	0xFFFF7800
 	#define NPK_SCI SCI1
 
 #elif defined(SH7055_35)
@@ -52,6 +101,7 @@
 	#define RAM_MIN	0xFFFF6000
 	#define RAM_MAX	0xFFFFDFFF
 	#define RAMJUMP_PRELOAD_META 0xffff8000
+	#define FL_MAXROM	(512*1024UL - 1UL)
 	#define NPK_SCI SCI1
 
 #elif defined(SH7051)
@@ -59,12 +109,15 @@
 	#define RAM_MIN	0xFFFFD800
 	#define RAM_MAX	0xFFFFFFFF
 	#define RAMJUMP_PRELOAD_META 0xffffD800
+	#define FL_MAXROM	(256*1024UL - 1UL)
 	#define NPK_SCI SCI2
 
 #else
 	#error No target specified !
 #endif
 
+#define FL_UCODE_SIZE	0x800
+
 
 
 /*** WDT and master clock stuff
@@ -86,6 +139,9 @@
 #define get_mclk_ts(x) (ATU0.TCNT)
 
 
+/** Erase block boundaries, ascending; the last entry (FL_MAXROM + 1) only marks the end of the last block */
+extern const u32 fblocks[];
+
 /** Ret 1 if ok
  *
  * sets *err to a negative response code if failed
@@ -105,7 +161,13 @@ void platf_flash_unprotect(void);
  */
 uint32_t platf_flash_eb(unsigned blockno);
 
-/** Write block of data. len must be multiple of SIDFL_WB_DLEN
+/** Number of erase pulses applied by the last platf_flash_eb() call.
+ *
+ * 0 if the block was already blank, or if the erase sequence isn't handled by the kernel (180nm microcode)
+ */
+unsigned platf_flash_eb_pulses(void);
+
+/** Write block of data. len must be multiple of SIDFL_WB_DLEN, and [dest, dest + len) must be entirely in flash
  *
  *
  * @return 0 if ok , response code ( > 0x80) if failed.